@@ -0,0 +1,272 @@
+// drives the wadfs callbacks in-process, no kernel mount or privileges needed
+#define WADFS_NO_MAIN
+#include "../wadfs/wadfs.cpp"
+
+#include <chrono>
+#include <thread>
+#include <map>
+
+static Mount* replayMount = nullptr;
+
+// stands in for libfuse, every callback finds the mount through its context
+extern "C" struct fuse_context* fuse_get_context(void) {
+    thread_local struct fuse_context context;
+    context.private_data = replayMount;
+    return &context;
+}
+
+struct TraceOp {
+    std::string type;
+    std::string path;
+    size_t size;
+    off_t offset;
+};
+
+static int collectEntry(void* buf, const char* name, const struct stat* stbuf, off_t off) {
+    ((std::vector<std::string>*)buf)->push_back(name);
+    return 0;
+}
+
+static int runOp(const TraceOp& op, std::vector<char>& buffer) {
+    struct stat st;
+    if (op.type == "getattr") {
+        return getattr_callback(op.path.c_str(), &st);
+    } else if (op.type == "readdir") {
+        std::vector<std::string> entries;
+        return readdir_callback(op.path.c_str(), &entries, collectEntry, 0, nullptr);
+    } else if (op.type == "read") {
+        buffer.resize(std::max(buffer.size(), op.size));
+        return read_callback(op.path.c_str(), buffer.data(), op.size, op.offset, nullptr);
+    } else if (op.type == "write") {
+        buffer.resize(std::max(buffer.size(), op.size), 'x');
+        return write_callback(op.path.c_str(), buffer.data(), op.size, op.offset, nullptr);
+    } else if (op.type == "mknod") {
+        return mknod_callback(op.path.c_str(), S_IFREG | 0644, 0);
+    } else if (op.type == "mkdir") {
+        return mkdir_callback(op.path.c_str(), 0755);
+    }
+    return -ENOSYS;
+}
+
+// what a level load looks like from the engine side: list everything, stat and read every lump
+static std::vector<TraceOp> levelLoadTrace() {
+    std::vector<TraceOp> trace;
+    std::vector<char> buffer;
+    std::function<void(const std::string&)> walk = [&](const std::string& dir) {
+        std::vector<std::string> entries;
+        readdir_callback(dir.c_str(), &entries, collectEntry, 0, nullptr);
+        trace.push_back(TraceOp{"readdir", dir, 0, 0});
+        for (const std::string& name : entries) {
+            if (name == "." || name == "..") {
+                continue;
+            }
+            std::string path = (dir == "/" ? "" : dir) + "/" + name;
+            struct stat st;
+            if (getattr_callback(path.c_str(), &st) != 0) {
+                continue;
+            }
+            trace.push_back(TraceOp{"getattr", path, 0, 0});
+            if (S_ISDIR(st.st_mode)) {
+                walk(path);
+                continue;
+            }
+            for (off_t offset = 0; offset < st.st_size; offset += 65536) {
+                trace.push_back(TraceOp{"read", path, 65536, offset});
+            }
+        }
+    };
+    walk("/");
+    return trace;
+}
+
+// an asset import into a fresh namespace, one namespace per thread so threads do not collide
+static std::vector<TraceOp> importTrace(size_t thread, size_t lumps, size_t size) {
+    const char* digits = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    std::string dir = std::string("/") + digits[(thread / 36) % 36] + digits[thread % 36];
+    std::vector<TraceOp> trace;
+    trace.push_back(TraceOp{"mkdir", dir, 0, 0});
+    for (size_t i = 0; i < lumps; ++i) {
+        char name[9];
+        snprintf(name, sizeof(name), "I%07zu", i);
+        std::string path = dir + "/" + name;
+        trace.push_back(TraceOp{"getattr", path, 0, 0});
+        trace.push_back(TraceOp{"mknod", path, 0, 0});
+        trace.push_back(TraceOp{"write", path, size, 0});
+        trace.push_back(TraceOp{"getattr", path, 0, 0});
+    }
+    return trace;
+}
+
+// recorded traces: one "op path [size offset]" per line
+static bool loadTrace(const std::string& file, std::vector<TraceOp>* trace) {
+    std::ifstream in(file);
+    if (!in) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        TraceOp op{"", "", 0, 0};
+        if (fields >> op.type >> op.path) {
+            fields >> op.size >> op.offset;
+            trace->push_back(op);
+        }
+    }
+    return true;
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+int main(int argc, char* argv[]) {
+    // usage: wadreplay [--threads=N] [--trace=levelload|import|FILE] [--lumps=N] [--size=B] [--repeat=N] [--json=FILE] [--spans=FILE] wad... 
+    // the wads are copied to a scratch location first so write traces leave the originals alone
+
+    size_t threads = 4;
+    std::string traceName = "levelload";
+    size_t lumps = 1000;
+    size_t size = 4096;
+    size_t repeat = 1;
+    std::string jsonPath;
+    std::string spansPath;
+    std::vector<std::string> wadPaths;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        std::string value = arg.substr(arg.find('=') + 1);
+        if (arg.rfind("--threads=", 0) == 0) {
+            threads = std::max<size_t>(1, std::stoull(value));
+        } else if (arg.rfind("--trace=", 0) == 0) {
+            traceName = value;
+        } else if (arg.rfind("--lumps=", 0) == 0) {
+            lumps = std::stoull(value);
+        } else if (arg.rfind("--size=", 0) == 0) {
+            size = std::stoull(value);
+        } else if (arg.rfind("--repeat=", 0) == 0) {
+            repeat = std::max<size_t>(1, std::stoull(value));
+        } else if (arg.rfind("--json=", 0) == 0) {
+            jsonPath = value;
+        } else if (arg.rfind("--spans=", 0) == 0) {
+            spansPath = value;
+        } else {
+            wadPaths.push_back(arg);
+        }
+    }
+    if (wadPaths.empty()) {
+        std::cout << "Usage: wadreplay [--threads=N] [--trace=levelload|import|FILE] [--lumps=N] [--size=B] [--repeat=N] [--json=FILE] [--spans=FILE] wad..." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (!spansPath.empty()) {
+        WadTrace::enable();
+    }
+
+    std::filesystem::path scratch = std::filesystem::temp_directory_path() / ("wadreplay-" + std::to_string(getpid()));
+    std::filesystem::create_directories(scratch);
+    std::vector<std::string> scratchPaths;
+    for (size_t i = 0; i < wadPaths.size(); ++i) {
+        std::filesystem::path copy = scratch / (std::to_string(i) + "-" + std::filesystem::path(wadPaths[i]).filename().string());
+        std::filesystem::copy(wadPaths[i], copy, std::filesystem::copy_options::recursive);
+        scratchPaths.push_back(copy.string());
+    }
+    replayMount = loadMount(scratchPaths, 256, 64);
+    if (!replayMount) {
+        std::cerr << "Could not open " << wadPaths.back() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<std::vector<TraceOp>> traces(threads);
+    if (traceName == "levelload") {
+        std::vector<TraceOp> trace = levelLoadTrace();
+        for (auto& threadTrace : traces) {
+            threadTrace = trace;
+        }
+    } else if (traceName == "import") {
+        for (size_t t = 0; t < threads; ++t) {
+            traces[t] = importTrace(t, lumps, size);
+        }
+    } else {
+        std::vector<TraceOp> trace;
+        if (!loadTrace(traceName, &trace)) {
+            std::cerr << "Could not read trace " << traceName << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        // recorded ops run once, split by top-level namespace so ops under one subtree keep their order
+        for (const TraceOp& op : trace) {
+            std::string top = op.path.substr(0, op.path.find('/', 1));
+            traces[std::hash<std::string>()(top) % threads].push_back(op);
+        }
+    }
+
+    // latencies in nanoseconds per op type, per thread, merged afterwards
+    std::vector<std::map<std::string, std::vector<uint64_t>>> latencies(threads);
+    // missing paths are part of normal traffic (lookups before create), so they are counted apart
+    std::vector<size_t> errors(threads, 0);
+    std::vector<size_t> missing(threads, 0);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            std::vector<char> buffer;
+            for (size_t r = 0; r < repeat; ++r) {
+                for (const TraceOp& op : traces[t]) {
+                    auto opStart = std::chrono::steady_clock::now();
+                    int result = runOp(op, buffer);
+                    auto elapsed = std::chrono::steady_clock::now() - opStart;
+                    latencies[t][op.type].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+                    errors[t] += result < 0 && result != -ENOENT ? 1 : 0;
+                    missing[t] += result == -ENOENT ? 1 : 0;
+                }
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::map<std::string, std::vector<uint64_t>> merged;
+    size_t totalOps = 0;
+    size_t totalErrors = 0;
+    size_t totalMissing = 0;
+    for (size_t t = 0; t < threads; ++t) {
+        for (auto& type : latencies[t]) {
+            merged[type.first].insert(merged[type.first].end(), type.second.begin(), type.second.end());
+            totalOps += type.second.size();
+        }
+        totalErrors += errors[t];
+        totalMissing += missing[t];
+    }
+
+    std::ostringstream json;
+    json << "{\"trace\":\"" << traceName << "\",\"threads\":" << threads << ",\"seconds\":" << seconds << ",\"ops\":" << totalOps << ",\"errors\":" << totalErrors << ",\"enoent\":" << totalMissing << ",\"latency_ns\":{";
+    printf("%-8s %10s %10s %10s %10s %10s\n", "op", "count", "mean_ns", "p50_ns", "p99_ns", "p999_ns");
+    bool first = true;
+    for (auto& type : merged) {
+        std::vector<uint64_t>& samples = type.second;
+        std::sort(samples.begin(), samples.end());
+        uint64_t sum = 0;
+        for (uint64_t sample : samples) {
+            sum += sample;
+        }
+        uint64_t mean = samples.empty() ? 0 : sum / samples.size();
+        printf("%-8s %10zu %10lu %10lu %10lu %10lu\n", type.first.c_str(), samples.size(), mean, percentile(samples, 0.5), percentile(samples, 0.99), percentile(samples, 0.999));
+        json << (first ? "" : ",") << "\"" << type.first << "\":{\"count\":" << samples.size() << ",\"mean\":" << mean << ",\"p50\":" << percentile(samples, 0.5) << ",\"p99\":" << percentile(samples, 0.99) << ",\"p999\":" << percentile(samples, 0.999) << "}";
+        first = false;
+    }
+    json << "}}";
+    printf("%zu ops in %.3f s (%.0f ops/s), %zu errors, %zu ENOENT\n", totalOps, seconds, seconds > 0 ? totalOps / seconds : 0, totalErrors, totalMissing);
+    if (!jsonPath.empty()) {
+        std::ofstream(jsonPath) << json.str() << std::endl;
+    }
+    if (!spansPath.empty() && !WadTrace::dump(spansPath)) {
+        std::cerr << "Could not write " << spansPath << std::endl;
+    }
+
+    std::error_code error;
+    std::filesystem::remove_all(scratch, error);
+    return 0;
+}
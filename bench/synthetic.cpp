@@ -0,0 +1,71 @@
+#include "synthetic.h"
+
+static const char* mapLumps[] = {"THINGS", "LINEDEFS", "SIDEDEFS", "VERTEXES", "SEGS", "SSECTORS", "NODES", "SECTORS", "REJECT", "BLOCKMAP"};
+
+// two character namespace names, unique among siblings
+static std::string namespaceName(size_t index) {
+    const char* digits = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    return std::string(1, digits[(index / 36) % 36]) + digits[index % 36];
+}
+
+bool generateSyntheticWad(const std::string &path, const SyntheticOptions &options, std::vector<std::string> *lumpPaths, std::vector<std::string> *namespacePaths) {
+    WadBuilder* builder = WadBuilder::create(path, options.magic);
+    if (!builder) {
+        return false;
+    }
+    std::mt19937_64 random(options.seed);
+    std::uniform_real_distribution<double> logSize(std::log(static_cast<double>(std::max<size_t>(options.minSize, 1))), std::log(static_cast<double>(std::max(options.maxSize, options.minSize))));
+    std::vector<char> data(std::max(options.maxSize, options.minSize));
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(random());
+    }
+    bool ok = true;
+
+    for (size_t map = 0; map < std::min<size_t>(options.maps, 81) && ok; ++map) {
+        std::string marker = "E" + std::to_string(map / 9 % 9 + 1) + "M" + std::to_string(map % 9 + 1);
+        ok = builder->addMarker(marker);
+        for (const char* lump : mapLumps) {
+            size_t size = static_cast<size_t>(std::exp(logSize(random)));
+            ok = ok && builder->addLump(lump, data.data(), size);
+            if (lumpPaths) {
+                lumpPaths->push_back("/" + marker + "/" + lump);
+            }
+        }
+    }
+
+    // lumps are spread evenly over the leaf namespaces
+    size_t leaves = 1;
+    for (size_t level = 0; level < options.depth; ++level) {
+        leaves *= options.fanout;
+    }
+    size_t next = 0;
+    std::function<void(size_t, const std::string&, size_t)> fill = [&](size_t level, const std::string &prefix, size_t leafIndex) {
+        if (level == options.depth) {
+            size_t count = options.lumps / leaves + (leafIndex < options.lumps % leaves ? 1 : 0);
+            for (size_t i = 0; i < count && ok; ++i, ++next) {
+                char name[9];
+                snprintf(name, sizeof(name), "L%07zu", next % 10000000);
+                size_t size = static_cast<size_t>(std::exp(logSize(random)));
+                ok = builder->addLump(name, data.data(), size);
+                if (lumpPaths) {
+                    lumpPaths->push_back(prefix + "/" + name);
+                }
+            }
+            if (namespacePaths && level > 0) {
+                namespacePaths->push_back(prefix);
+            }
+            return;
+        }
+        for (size_t child = 0; child < options.fanout && ok; ++child) {
+            std::string name = namespaceName(child);
+            ok = builder->beginNamespace(name);
+            fill(level + 1, prefix + "/" + name, leafIndex * options.fanout + child);
+            ok = ok && builder->endNamespace();
+        }
+    };
+    fill(0, "", 0);
+
+    ok = builder->finish() && ok;
+    delete builder;
+    return ok;
+}
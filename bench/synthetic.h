@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cmath>
+#include <random>
+#include "../libWad/WadBuilder.h"
+
+// shape of a generated archive
+struct SyntheticOptions {
+    size_t lumps = 10000;
+    // nesting depth of the namespace tree and namespaces per level
+    size_t depth = 2;
+    size_t fanout = 4;
+    // E#M# maps (at most 81), ten standard lumps each, counted on top of lumps
+    size_t maps = 9;
+    // lump sizes are drawn log-uniformly from [minSize, maxSize]
+    size_t minSize = 16;
+    size_t maxSize = 65536;
+    unsigned seed = 1;
+    std::string magic = "PWAD";
+};
+
+// builds the archive and returns the paths of every lump and leaf namespace in it
+bool generateSyntheticWad(const std::string &path, const SyntheticOptions &options, std::vector<std::string> *lumpPaths = nullptr, std::vector<std::string> *namespacePaths = nullptr);
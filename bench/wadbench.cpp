@@ -0,0 +1,304 @@
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <map>
+#include <new>
+#include <unistd.h>
+#include "synthetic.h"
+#include "../libWad/WadOverlay.h"
+
+// every heap allocation in the process is counted, so benchmarks can report allocations per op
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+// one generated archive per lump count, shared by every benchmark that only reads
+struct Fixture {
+    std::string path;
+    std::vector<std::string> lumps;
+    std::vector<std::string> namespaces;
+};
+
+static std::string scratchPath(const std::string &name) {
+    return (std::filesystem::temp_directory_path() / ("wadbench-" + std::to_string(getpid()) + "-" + name)).string();
+}
+
+static Fixture& fixture(size_t lumps) {
+    static std::map<size_t, Fixture> fixtures;
+    auto it = fixtures.find(lumps);
+    if (it != fixtures.end()) {
+        return it->second;
+    }
+    Fixture& created = fixtures[lumps];
+    created.path = scratchPath(std::to_string(lumps) + ".wad");
+    SyntheticOptions options;
+    options.lumps = lumps;
+    options.maxSize = 4096;
+    generateSyntheticWad(created.path, options, &created.lumps, &created.namespaces);
+    return created;
+}
+
+static void removeFixtures() {
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(std::filesystem::temp_directory_path(), error)) {
+        if (entry.path().filename().string().rfind("wadbench-" + std::to_string(getpid()) + "-", 0) == 0) {
+            std::filesystem::remove(entry.path(), error);
+        }
+    }
+}
+
+static void BM_LoadWad(benchmark::State& state) {
+    Fixture& f = fixture(state.range(0));
+    for (auto _ : state) {
+        Wad* wad = Wad::loadWad(f.path);
+        benchmark::DoNotOptimize(wad);
+        delete wad;
+    }
+    state.SetItemsProcessed(state.iterations() * f.lumps.size());
+}
+BENCHMARK(BM_LoadWad)->Arg(1000)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+static void BM_IsContent(benchmark::State& state) {
+    Fixture& f = fixture(state.range(0));
+    Wad* wad = Wad::loadWad(f.path);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(wad->isContent(f.lumps[i++ % f.lumps.size()]));
+    }
+    state.SetItemsProcessed(state.iterations());
+    delete wad;
+}
+BENCHMARK(BM_IsContent)->Arg(1000)->Arg(10000)->Arg(100000);
+
+static void BM_IsDirectory(benchmark::State& state) {
+    Fixture& f = fixture(state.range(0));
+    Wad* wad = Wad::loadWad(f.path);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(wad->isDirectory(f.namespaces[i++ % f.namespaces.size()]));
+    }
+    state.SetItemsProcessed(state.iterations());
+    delete wad;
+}
+BENCHMARK(BM_IsDirectory)->Arg(1000)->Arg(10000)->Arg(100000);
+
+static void BM_GetSize(benchmark::State& state) {
+    Fixture& f = fixture(state.range(0));
+    Wad* wad = Wad::loadWad(f.path);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(wad->getSize(f.lumps[i++ % f.lumps.size()]));
+    }
+    state.SetItemsProcessed(state.iterations());
+    delete wad;
+}
+BENCHMARK(BM_GetSize)->Arg(1000)->Arg(10000)->Arg(100000);
+
+static void BM_OverlayGetSize(benchmark::State& state) {
+    Fixture& f = fixture(state.range(0));
+    WadOverlay* wad = WadOverlay::loadOverlay({f.path});
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(wad->getSize(f.lumps[i++ % f.lumps.size()]));
+    }
+    state.SetItemsProcessed(state.iterations());
+    delete wad;
+}
+BENCHMARK(BM_OverlayGetSize)->Arg(1000)->Arg(10000)->Arg(100000);
+
+static void BM_GetDirectory(benchmark::State& state) {
+    Fixture& f = fixture(state.range(0));
+    Wad* wad = Wad::loadWad(f.path);
+    size_t i = 0;
+    for (auto _ : state) {
+        std::vector<std::string> entries;
+        wad->getDirectory(f.namespaces[i++ % f.namespaces.size()], &entries);
+        benchmark::DoNotOptimize(entries.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+    delete wad;
+}
+BENCHMARK(BM_GetDirectory)->Arg(1000)->Arg(10000)->Arg(100000);
+
+// a prefix pattern per lookup, the packed name index is built by the first search
+static void BM_FindLumps(benchmark::State& state) {
+    Fixture& f = fixture(state.range(0));
+    Wad* wad = Wad::loadWad(f.path);
+    size_t i = 0;
+    for (auto _ : state) {
+        std::string lump = f.lumps[i++ % f.lumps.size()];
+        std::string name = lump.substr(lump.rfind('/') + 1);
+        std::vector<Node*> matches;
+        wad->findLumps(name.substr(0, 5) + "*", &matches);
+        benchmark::DoNotOptimize(matches.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+    delete wad;
+}
+BENCHMARK(BM_FindLumps)->Arg(1000)->Arg(10000)->Arg(100000);
+
+static void BM_GetContents(benchmark::State& state) {
+    Fixture& f = fixture(10000);
+    Wad* wad = Wad::loadWad(f.path);
+    std::vector<char> buffer(state.range(0));
+    size_t i = 0;
+    uint64_t bytes = 0;
+    for (auto _ : state) {
+        ssize_t n = wad->getContents(f.lumps[i++ % f.lumps.size()], buffer.data(), buffer.size());
+        bytes += n > 0 ? n : 0;
+    }
+    state.SetBytesProcessed(bytes);
+    delete wad;
+}
+BENCHMARK(BM_GetContents)->Arg(512)->Arg(4096);
+
+// same reads against a block compressed copy, includes decompression and the block cache
+static void BM_GetContentsCompressed(benchmark::State& state) {
+    Fixture& f = fixture(10000);
+    std::string copy = scratchPath("compressed.wad");
+    Wad* source = Wad::loadWad(f.path);
+    bool converted = source->convertTo(copy, WAD_EXTENDED_MAGIC, true);
+    delete source;
+    if (!converted) {
+        state.SkipWithError("libWad built without zlib");
+        return;
+    }
+    Wad* wad = Wad::loadWad(copy);
+    std::vector<char> buffer(state.range(0));
+    size_t i = 0;
+    uint64_t bytes = 0;
+    for (auto _ : state) {
+        ssize_t n = wad->getContents(f.lumps[i++ % f.lumps.size()], buffer.data(), buffer.size());
+        bytes += n > 0 ? n : 0;
+    }
+    state.SetBytesProcessed(bytes);
+    delete wad;
+    std::filesystem::remove(copy);
+}
+BENCHMARK(BM_GetContentsCompressed)->Arg(512)->Arg(4096);
+
+// the string_view lookup and read paths must not touch the heap at all, fails the run if they do
+static void BM_LookupAllocations(benchmark::State& state) {
+    Fixture& f = fixture(state.range(0));
+    Wad* wad = Wad::loadWad(f.path);
+    WadOverlay* overlay = WadOverlay::loadOverlay({f.path});
+    char buffer[64];
+    // first calls on a thread register its stats slot
+    wad->getSize(std::string_view(f.lumps.front()));
+    size_t i = 0;
+    size_t before = allocations.load();
+    for (auto _ : state) {
+        std::string_view lump = f.lumps[i % f.lumps.size()];
+        std::string_view dir = f.namespaces[i++ % f.namespaces.size()];
+        benchmark::DoNotOptimize(wad->getNode(lump));
+        benchmark::DoNotOptimize(wad->isContent(lump));
+        benchmark::DoNotOptimize(wad->isDirectory(dir));
+        benchmark::DoNotOptimize(wad->getSize(lump));
+        benchmark::DoNotOptimize(wad->getContents(lump, buffer, sizeof(buffer)));
+        benchmark::DoNotOptimize(overlay->isContent(lump));
+        benchmark::DoNotOptimize(overlay->getContents(lump, buffer, sizeof(buffer)));
+    }
+    size_t made = allocations.load() - before;
+    state.counters["allocs_per_iter"] = benchmark::Counter(static_cast<double>(made) / state.iterations());
+    if (made) {
+        state.SkipWithError("string_view lookup path allocated");
+    }
+    state.SetItemsProcessed(state.iterations() * 7);
+    delete overlay;
+    delete wad;
+}
+BENCHMARK(BM_LookupAllocations)->Arg(1000)->Arg(10000);
+
+// writes grow the archive, so each run gets its own copy
+static void BM_CreateFile(benchmark::State& state) {
+    Fixture& f = fixture(state.range(0));
+    std::string copy = scratchPath("create.wad");
+    std::filesystem::copy_file(f.path, copy, std::filesystem::copy_options::overwrite_existing);
+    Wad* wad = Wad::loadWad(copy);
+    std::string dir = f.namespaces.front();
+    size_t i = 0;
+    for (auto _ : state) {
+        char name[9];
+        snprintf(name, sizeof(name), "C%07zu", i++);
+        wad->createFile(dir + "/" + name);
+    }
+    state.SetItemsProcessed(state.iterations());
+    delete wad;
+    std::filesystem::remove(copy);
+}
+BENCHMARK(BM_CreateFile)->Arg(1000)->Arg(10000)->Iterations(500);
+
+static void BM_WriteToFile(benchmark::State& state) {
+    Fixture& f = fixture(state.range(0));
+    std::string copy = scratchPath("write.wad");
+    std::filesystem::copy_file(f.path, copy, std::filesystem::copy_options::overwrite_existing);
+    Wad* wad = Wad::loadWad(copy);
+    std::string dir = f.namespaces.front();
+    std::vector<char> data(4096, 'x');
+    size_t i = 0;
+    for (auto _ : state) {
+        char name[9];
+        snprintf(name, sizeof(name), "W%07zu", i++);
+        std::string path = dir + "/" + name;
+        state.PauseTiming();
+        wad->createFile(path);
+        state.ResumeTiming();
+        wad->writeToFile(path, data.data(), data.size());
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * data.size());
+    delete wad;
+    std::filesystem::remove(copy);
+}
+BENCHMARK(BM_WriteToFile)->Arg(1000)->Arg(10000)->Iterations(500);
+
+// the write path alone, lumps looked up ahead of time, through pwrite (0) or the shared mapping (1)
+// small lumps share pages, so mapped bursts neither fault nor make system calls between growth steps
+static void BM_WriteBurst(benchmark::State& state) {
+    Fixture& f = fixture(10000);
+    std::string copy = scratchPath("burst.wad");
+    std::filesystem::copy_file(f.path, copy, std::filesystem::copy_options::overwrite_existing);
+    Wad* wad = Wad::loadWad(copy);
+    wad->setMappedWrites(state.range(0));
+    std::vector<char> data(state.range(1), 'x');
+    std::vector<Node*> nodes;
+    for (size_t i = 0; i < 20000; ++i) {
+        char name[10];
+        snprintf(name, sizeof(name), "/B%07zu", i);
+        wad->createFile(name);
+        nodes.push_back(wad->getNode(name));
+    }
+    size_t i = 0;
+    for (auto _ : state) {
+        wad->writeToFile(nodes[i++], data.data(), data.size());
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * data.size());
+    delete wad;
+    std::filesystem::remove(copy);
+}
+BENCHMARK(BM_WriteBurst)->Args({0, 64})->Args({1, 64})->Args({0, 4096})->Args({1, 4096})->Iterations(20000);
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    removeFixtures();
+    return 0;
+}
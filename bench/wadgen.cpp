@@ -0,0 +1,40 @@
+#include "synthetic.h"
+
+int main(int argc, char* argv[]) {
+    // usage: wadgen [--lumps=N] [--depth=N] [--fanout=N] [--maps=N] [--min-size=B] [--max-size=B] [--seed=N] [--magic=M] output.wad
+
+    SyntheticOptions options;
+    std::string output;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        std::string value = arg.substr(arg.find('=') + 1);
+        if (arg.rfind("--lumps=", 0) == 0) {
+            options.lumps = std::stoull(value);
+        } else if (arg.rfind("--depth=", 0) == 0) {
+            options.depth = std::stoull(value);
+        } else if (arg.rfind("--fanout=", 0) == 0) {
+            options.fanout = std::stoull(value);
+        } else if (arg.rfind("--maps=", 0) == 0) {
+            options.maps = std::stoull(value);
+        } else if (arg.rfind("--min-size=", 0) == 0) {
+            options.minSize = std::stoull(value);
+        } else if (arg.rfind("--max-size=", 0) == 0) {
+            options.maxSize = std::stoull(value);
+        } else if (arg.rfind("--seed=", 0) == 0) {
+            options.seed = std::stoul(value);
+        } else if (arg.rfind("--magic=", 0) == 0) {
+            options.magic = value;
+        } else {
+            output = arg;
+        }
+    }
+    if (output.empty()) {
+        std::cout << "Usage: wadgen [--lumps=N] [--depth=N] [--fanout=N] [--maps=N] [--min-size=B] [--max-size=B] [--seed=N] [--magic=M] output.wad" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!generateSyntheticWad(output, options)) {
+        std::cerr << "Could not generate " << output << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
@@ -1,78 +1,522 @@
 #include "Wad.h"
+#include "WadVerify.h"
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
-Wad::Wad(const std::string &path) : filePath(path), root(nullptr) {
-    fileStream.open(filePath, std::ios::in | std::ios::out | std::ios::binary);
+// what a node adds to getMemoryUsage, including its slot in the parent's children
+static size_t nodeBytes(const Node* node) {
+    return sizeof(Node) + node->filename.capacity() + node->fullPath.capacity() + sizeof(Node*);
+}
 
-    // header
-    char fileMagic[4];
-    fileStream.read(fileMagic, 4);
-    fileStream.read(reinterpret_cast<char*>(&numDescriptor), 4);
-    fileStream.read(reinterpret_cast<char*>(&directoryOffset), 4);
-    magic = std::string(fileMagic, 4);
+static size_t subtreeBytes(const Node* node) {
+    size_t bytes = nodeBytes(node);
+    for (const Node* child : node->children) {
+        bytes += subtreeBytes(child);
+    }
+    return bytes;
+}
+
+// header fields as stored, read by the constructor and again by refresh
+struct TableHeader {
+    std::string magic;
+    bool extended = false;
+    bool compressed = false;
+    uint64_t count = 0;
+    uint64_t offset = 0;
+};
+
+// false when the header cannot be read or points the table past the end of the file
+static bool readTableHeader(int fd, TableHeader &header) {
+    char buffer[WAD_EXTENDED_HEADER_SIZE] = {0};
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || pread(fd, buffer, WAD_EXTENDED_HEADER_SIZE, 0) < WAD_CLASSIC_HEADER_SIZE) {
+        return false;
+    }
+    header.magic = std::string(buffer, 4);
+    header.extended = header.magic == WAD_EXTENDED_MAGIC;
+    if (header.extended) {
+        uint32_t flags;
+        std::memcpy(&flags, buffer + 4, 4);
+        header.compressed = flags & WAD_FLAG_COMPRESSED;
+        std::memcpy(&header.count, buffer + 8, 8);
+        std::memcpy(&header.offset, buffer + 16, 8);
+    } else {
+        uint32_t count, offset;
+        std::memcpy(&count, buffer + 4, 4);
+        std::memcpy(&offset, buffer + 8, 4);
+        header.count = count;
+        header.offset = offset;
+    }
+    // a table running past the end of the file is half written or damaged
+    uint64_t size = st.st_size;
+    return header.offset <= size && header.count <= (size - header.offset) / (header.extended ? 24 : 16);
+}
 
-    // create n-ary tree from descriptor list
+Wad::Wad(const std::string &path) : filePath(path), numDescriptor(0), directoryOffset(0), extended(false), root(nullptr) {
+    // one descriptor for the lifetime of the wad, closed in the destructor
+    // a file that cannot be written (an installed IWAD, a lower layer) is still served, read only
+    fd = open(filePath.c_str(), O_RDWR);
+    if (fd < 0 && (errno == EACCES || errno == EPERM || errno == EROFS)) {
+        fd = open(filePath.c_str(), O_RDONLY);
+        readOnly = fd >= 0;
+    }
     root = new Node("/", false);
+    treeBytes = nodeBytes(root);
+
+    // header
+    TableHeader header;
+    bool readable = readTableHeader(fd, header);
+    magic = header.magic;
+    extended = header.extended;
+    compressed = header.compressed;
+    directoryOffset = header.offset;
+
+    // read the whole descriptor list in one go
+    std::vector<char> table(readable ? header.count * descriptorSize() : 0);
+    if (readable && pread(fd, table.data(), table.size(), header.offset) == static_cast<ssize_t>(table.size())) {
+        numDescriptor = header.count;
+        descriptors.reserve(numDescriptor);
+        parseTable(table, 0, nullptr);
+    }
+    measureFile();
+}
+
+// where appends start and how far the table reaches, from the file as it is now
+void Wad::measureFile() {
+    struct stat st;
+    uint64_t size = fd >= 0 && fstat(fd, &st) == 0 ? st.st_size : 0;
+    tableLimit = directoryOffset + numDescriptor * descriptorSize();
+    fileEnd = std::max(size, tableLimit);
+}
+
+void Wad::decodeDescriptor(const char *descriptor, uint64_t &offset, uint64_t &length, std::string_view &name) {
+    if (extended) {
+        std::memcpy(&offset, descriptor, 8);
+        std::memcpy(&length, descriptor + 8, 8);
+    } else {
+        uint32_t classicOffset, classicLength;
+        std::memcpy(&classicOffset, descriptor, 4);
+        std::memcpy(&classicLength, descriptor + 4, 4);
+        offset = classicOffset;
+        length = classicLength;
+    }
+    name = std::string_view(descriptor + descriptorSize() - 8, strnlen(descriptor + descriptorSize() - 8, 8));
+}
+
+// builds the n-ary tree for table entries first on, descriptors must hold exactly the nodes before first
+// the open namespaces and map are recovered from the last node kept, so parsing resumes where the
+// loader would have been, added receives the new nodes whose parent was kept
+void Wad::parseTable(const std::vector<char> &table, uint64_t first, std::vector<Node*> *added) {
     std::vector<Node*> fileStack;
-    fileStack.push_back(root);
-    fileStream.seekg(directoryOffset, std::ios::beg);
-    Node* E1M0 = nullptr;
-    int E1M0files = 0;
+    Node* previous = nullptr;
+    for (uint64_t i = first; i > 0 && !previous; --i) {
+        previous = descriptors[i - 1];
+    }
+    Node* top = root;
+    if (previous && previous->isFile) {
+        top = previous->parent;
+    } else if (previous && WadNames::isNamespaceEnd(previous->filename)) {
+        // the _END sits under what it closed, a stray one at the top level closed nothing
+        top = previous->parent == root ? root : previous->parent->parent;
+    } else if (previous) {
+        top = previous;
+    }
+    for (Node* node = top; node; node = node->parent) {
+        fileStack.insert(fileStack.begin(), node);
+    }
+    // the map whose lumps are still being collected, and the rank its last lump had
+    Node* map = top != root && WadNames::isMapMarker(top->filename) ? top : nullptr;
+    int mapRank = -1;
+    if (map) {
+        for (Node* child : map->children) {
+            mapRank = WadNames::nextMapRank(mapRank, child->filename);
+        }
+    }
 
-    for (uint32_t i = 0; i < numDescriptor; ++i) {
-        uint32_t offset, length;
-        char name[8];
-        fileStream.read(reinterpret_cast<char*>(&offset), 4);
-        fileStream.read(reinterpret_cast<char*>(&length), 4);
-        fileStream.read(name, 8);
-        std::string filename(name, 8);
-        Node* newNode = nullptr;
-        // remove new line
-        size_t nullCharPos = filename.find('\0');
-        if (nullCharPos != std::string::npos) {
-            filename.erase(nullCharPos);
-        }
-        // adjust node depending on if directory _START/_END/map or file
-        if (filename.size() >= 6 && filename.substr(filename.size() - 6) == "_START") {
-            newNode = new Node(filename, false, offset, length, fileStack.back());
-            fileStack.back()->children.push_back(newNode);
-            fileStack.push_back(newNode);
-        } 
-        else if (filename.size() >= 4 && filename.substr(filename.size() - 4) == "_END") {
-            newNode = new Node(filename, false, offset, length, fileStack.back());
-            fileStack.back()->children.push_back(newNode);
-            fileStack.pop_back();
-        } 
-        else if (filename.size() == 4 && (filename[0] == 'E' && isdigit(filename[1]) && filename[2] == 'M' && isdigit(filename[3]))) {
-            E1M0 = new Node(filename, false, offset, length, fileStack.back());
-            fileStack.back()->children.push_back(E1M0);
-            fileStack.push_back(E1M0);
-            E1M0files = 0;
-        } 
-        else {
-            newNode = new Node(filename, true, offset, length, fileStack.back());
-            fileStack.back()->children.push_back(newNode);
-            // acts as E1M0 _END once 10 files are reached so that everything is not under E1M0
-            if (E1M0 != nullptr) {
-                E1M0files += 1;
-                if (E1M0files == 10) {
+    for (uint64_t i = first; i < table.size() / descriptorSize(); ++i) {
+        uint64_t offset = 0, length = 0;
+        std::string_view name;
+        decodeDescriptor(table.data() + i * descriptorSize(), offset, length, name);
+        // tombstone left by a remove, keeps its slot so indices still match the table
+        if (name.empty()) {
+            descriptors.push_back(nullptr);
+            tombstones++;
+            continue;
+        }
+        WadNameKind kind = WadNames::classify(name);
+        // a map ends at the first descriptor that is not one of its lumps, or not in their order
+        if (map) {
+            mapRank = kind == WadNameKind::Lump ? WadNames::nextMapRank(mapRank, name) : -1;
+            if (mapRank < 0) {
+                fileStack.pop_back();
+                map = nullptr;
+            }
+        }
+        std::string filename(name);
+        Node* newNode = new Node(filename, kind == WadNameKind::Lump, offset, length, fileStack.back());
+        fileStack.back()->children.push_back(newNode);
+        treeBytes += nodeBytes(newNode);
+        if (added && (newNode->parent == root || newNode->parent->index < first)) {
+            added->push_back(newNode);
+        }
+        switch (kind) {
+            case WadNameKind::NamespaceStart:
+                fileStack.push_back(newNode);
+                break;
+            case WadNameKind::NamespaceEnd:
+                // a stray _END at the top level has nothing to close
+                if (fileStack.size() > 1) {
                     fileStack.pop_back();
-                    E1M0 = nullptr;
                 }
-            }
+                break;
+            case WadNameKind::MapMarker:
+                fileStack.push_back(newNode);
+                map = newNode;
+                mapRank = -1;
+                break;
+            case WadNameKind::Lump:
+                break;
         }
+        newNode->index = i;
+        descriptors.push_back(newNode);
     }
-    fileStream.flush();
-    fileStream.close();
 }
 
 Wad* Wad::loadWad(const std::string &path) {
-    return new Wad(path);
+    Wad* wad = new Wad(path);
+    if (wad->fd < 0 || (wad->compressed && !WadCodec::available())) {
+        delete wad;
+        return nullptr;
+    }
+    return wad;
+}
+
+Wad::~Wad() {
+    std::function<void(Node*)> freeTree = [&](Node* node) {
+        for (Node* child : node->children) {
+            freeTree(child);
+        }
+        delete node;
+    };
+    freeTree(root);
+    if (mappedWrites) {
+        unmapFile();
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+Node* Wad::getRoot() {
+    return root;
+}
+
+Node* Wad::getNode(std::string_view path) {
+    WadStatsTimer timer(WadStats::Lookup);
+    WadStats::add(WadStats::Lookups);
+    return lookup(path);
+}
+
+size_t Wad::getMemoryUsage() {
+    // approximate heap footprint of the node tree and caches, used to budget resident archives
+    size_t bytes = sizeof(Wad);
+    {
+        std::lock_guard<std::mutex> table(tableLock);
+        bytes += treeBytes + descriptors.capacity() * sizeof(Node*);
+        bytes += contentIndex.size() * (sizeof(uint64_t) + 2 * sizeof(uint64_t) + 2 * sizeof(void*));
+    }
+    std::lock_guard<std::mutex> cache(cacheLock);
+    bytes += blockCacheUsed + blockCache.size() * (sizeof(CachedBlock) + 4 * sizeof(void*));
+    bytes += blockIndexBytes;
+    return bytes;
 }
 
 std::string Wad::getMagic() {
     return this->magic;
 }
 
+std::string Wad::getFilePath() {
+    return filePath;
+}
+
+bool Wad::isExtended() {
+    return extended;
+}
+
+bool Wad::isCompressed() {
+    return compressed;
+}
+
+bool Wad::isReadOnly() {
+    return readOnly;
+}
+
+void Wad::setBlockCacheSize(size_t bytes) {
+    blockCacheLimit = bytes;
+}
+
+size_t Wad::descriptorSize() {
+    return extended ? 24 : 16;
+}
+
+void Wad::encodeExtent(char *descriptor, uint64_t offset, uint64_t length) {
+    if (extended) {
+        std::memcpy(descriptor, &offset, 8);
+        std::memcpy(descriptor + 8, &length, 8);
+    } else {
+        uint32_t classicOffset = static_cast<uint32_t>(offset);
+        uint32_t classicLength = static_cast<uint32_t>(length);
+        std::memcpy(descriptor, &classicOffset, 4);
+        std::memcpy(descriptor + 4, &classicLength, 4);
+    }
+}
+
+void Wad::encodeDescriptor(char *descriptor, uint64_t offset, uint64_t length, const std::string &name) {
+    std::memset(descriptor, 0, descriptorSize());
+    encodeExtent(descriptor, offset, length);
+    std::memcpy(descriptor + descriptorSize() - 8, name.c_str(), std::min<size_t>(name.size(), 8));
+}
+
+bool Wad::writeHeader() {
+    if (extended) {
+        return writeAt(&numDescriptor, 8, 8) && writeAt(&directoryOffset, 8, 16);
+    }
+    uint32_t count = static_cast<uint32_t>(numDescriptor);
+    uint32_t offset = static_cast<uint32_t>(directoryOffset);
+    return writeAt(&count, 4, 4) && writeAt(&offset, 4, 8);
+}
+
+// rewrites one descriptor in place
+bool Wad::writeDescriptor(Node* node) {
+    char descriptor[24];
+    encodeDescriptor(descriptor, node->offset, node->length, node->filename);
+    namesIndexed = false;
+    return writeAt(descriptor, descriptorSize(), directoryOffset + node->index * descriptorSize());
+}
+
+// the node leaves the table only once its zeroed descriptor is on disk
+bool Wad::markTombstone(Node* node) {
+    char descriptor[24] = {0};
+    if (!writeAt(descriptor, descriptorSize(), directoryOffset + node->index * descriptorSize())) {
+        return false;
+    }
+    descriptors[node->index] = nullptr;
+    tombstones++;
+    namesIndexed = false;
+    return true;
+}
+
+// every node or, when a write fails, none of them
+bool Wad::markTombstones(const std::vector<Node*> &nodes) {
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (!markTombstone(nodes[i])) {
+            while (i > 0) {
+                reviveTombstone(nodes[--i]);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+// undoes markTombstone, on disk as far as the file still takes writes
+void Wad::reviveTombstone(Node* node) {
+    descriptors[node->index] = node;
+    tombstones--;
+    writeDescriptor(node);
+}
+
+// encodes count entries to the table at offset, tombstones as zeros
+// mapped, the descriptors are encoded in place, otherwise staged for one pwrite
+bool Wad::writeEntries(uint64_t offset, Node* const *entries, size_t count) {
+    std::vector<char> buffer;
+    char* out = writable(offset, count * descriptorSize());
+    if (!out) {
+        buffer.resize(count * descriptorSize());
+        out = buffer.data();
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (entries[i]) {
+            encodeDescriptor(out + i * descriptorSize(), entries[i]->offset, entries[i]->length, entries[i]->filename);
+        } else {
+            std::memset(out + i * descriptorSize(), 0, descriptorSize());
+        }
+    }
+    return buffer.empty() || writeAt(buffer.data(), buffer.size(), offset);
+}
+
+// writes inserted followed by the live descriptors from position on to the table at tableOffset,
+// dropping tombstones in that range, everything behind position is renumbered
+// a table written somewhere new takes the entries in front of position along, tombstones included
+// memory only changes once the writes went through
+bool Wad::rewriteTable(uint64_t position, const std::vector<Node*> &inserted, uint64_t tableOffset) {
+    if (tableOffset != directoryOffset && position > 0 && !writeEntries(tableOffset, descriptors.data(), position)) {
+        return false;
+    }
+    std::vector<Node*> tail(inserted);
+    uint64_t dropped = 0;
+    for (uint64_t i = position; i < descriptors.size(); ++i) {
+        if (descriptors[i]) {
+            tail.push_back(descriptors[i]);
+        } else {
+            dropped++;
+        }
+    }
+    if (!writeEntries(tableOffset + position * descriptorSize(), tail.data(), tail.size())) {
+        return false;
+    }
+    tombstones -= dropped;
+    descriptors.resize(position);
+    for (size_t i = 0; i < tail.size(); ++i) {
+        tail[i]->index = position + i;
+        descriptors.push_back(tail[i]);
+    }
+    numDescriptor = descriptors.size();
+    namesIndexed = false;
+    return true;
+}
+
+// size of the table once rewriteTable(position, inserted) dropped the tombstones behind position
+uint64_t Wad::rewrittenCount(uint64_t position, size_t inserted) {
+    if (tombstones == 0) {
+        return descriptors.size() + inserted;
+    }
+    uint64_t count = position + inserted;
+    for (uint64_t i = position; i < descriptors.size(); ++i) {
+        count += descriptors[i] != nullptr;
+    }
+    return count;
+}
+
+// whether insertDescriptors can take inserted more entries, counting every tombstone as kept,
+// for callers that must know before they change anything
+bool Wad::tableRoom(size_t inserted) {
+    uint64_t bytes = (descriptors.size() + inserted) * descriptorSize();
+    uint64_t end = fileEnd.load();
+    return extended || directoryOffset + bytes <= tableLimit || end == tableLimit || end + bytes <= UINT32_MAX;
+}
+
+// rewrites the table into a fresh range at the end of the file, false when classic offsets cannot
+// reach that far
+// the range it had comes back in oldOffset and oldSize, the caller frees it once the header points
+// at the new table: appends write unlocked into freed space and must not overwrite the table the
+// file still names
+// half the table again is reserved behind it, so the creates that follow grow it in place
+bool Wad::moveTable(uint64_t position, const std::vector<Node*> &inserted, uint64_t &oldOffset, uint64_t &oldSize) {
+    uint64_t bytes = rewrittenCount(position, inserted.size()) * descriptorSize();
+    uint64_t slack = std::max<uint64_t>(bytes / 2, 64 * descriptorSize());
+    uint64_t tableOffset;
+    if (!reserve(bytes + slack, tableOffset)) {
+        slack = 0;
+        if (!reserve(bytes, tableOffset)) {
+            return false;
+        }
+    }
+    if (!rewriteTable(position, inserted, tableOffset)) {
+        releaseRange(tableOffset, bytes + slack);
+        return false;
+    }
+    oldOffset = directoryOffset;
+    oldSize = tableLimit - directoryOffset;
+    directoryOffset = tableOffset;
+    tableLimit = tableOffset + bytes + slack;
+    WadStats::add(WadStats::DirectoryRelocations);
+    return true;
+}
+
+bool Wad::convertTo(const std::string &path, const std::string &magic, bool compress) {
+    // rewrite the archive in another on-disk variant, lump data is packed back to back
+    bool toExtended = magic == WAD_EXTENDED_MAGIC;
+    if (magic.size() != 4 || (!toExtended && magic != "IWAD" && magic != "PWAD")) {
+        return false;
+    }
+    if (compress && (!toExtended || !WadCodec::available())) {
+        return false;
+    }
+    // the output is truncated on open, pointed at the archive itself (or a link to it) that would
+    // destroy the source before a byte of it was read
+    struct stat target, source;
+    if (stat(path.c_str(), &target) == 0 && fstat(fd, &source) == 0 && target.st_dev == source.st_dev && target.st_ino == source.st_ino) {
+        return false;
+    }
+    int out = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        return false;
+    }
+    size_t headerSize = toExtended ? WAD_EXTENDED_HEADER_SIZE : WAD_CLASSIC_HEADER_SIZE;
+    size_t outDescriptorSize = toExtended ? 24 : 16;
+    std::vector<char> directory;
+    uint64_t count = 0;
+    uint64_t dataEnd = headerSize;
+    std::vector<char> chunk(1 << 20);
+    bool ok = true;
+    std::function<void(Node*)> emit = [&](Node* node) {
+        if (!ok) {
+            return;
+        }
+        if (node != root) {
+            uint64_t newOffset = node->length > 0 ? dataEnd : 0;
+            if (compress && node->length > 0) {
+                // lumps are encoded whole, so each one has to fit in memory once
+                std::vector<char> raw(node->length);
+                std::vector<char> blob;
+                ok = readExtent(node->offset, node->length, raw.data(), raw.size(), 0) == static_cast<ssize_t>(raw.size()) && WadCodec::encode(raw.data(), raw.size(), &blob);
+                ok = ok && pwrite(out, blob.data(), blob.size(), dataEnd) == static_cast<ssize_t>(blob.size());
+                dataEnd += blob.size();
+            }
+            for (uint64_t copied = 0; !compress && copied < node->length && ok; ) {
+                size_t n = std::min<uint64_t>(chunk.size(), node->length - copied);
+                ok = readExtent(node->offset, node->length, chunk.data(), n, copied) == static_cast<ssize_t>(n) && pwrite(out, chunk.data(), n, dataEnd) == static_cast<ssize_t>(n);
+                copied += n;
+                dataEnd += n;
+            }
+            char descriptor[24] = {0};
+            if (toExtended) {
+                std::memcpy(descriptor, &newOffset, 8);
+                std::memcpy(descriptor + 8, &node->length, 8);
+            } else {
+                uint32_t classicOffset = static_cast<uint32_t>(newOffset);
+                uint32_t classicLength = static_cast<uint32_t>(node->length);
+                std::memcpy(descriptor, &classicOffset, 4);
+                std::memcpy(descriptor + 4, &classicLength, 4);
+            }
+            std::memcpy(descriptor + outDescriptorSize - 8, node->filename.c_str(), std::min<size_t>(node->filename.size(), 8));
+            directory.insert(directory.end(), descriptor, descriptor + outDescriptorSize);
+            count++;
+        }
+        for (Node* child : node->children) {
+            emit(child);
+        }
+    };
+    emit(root);
+    // classic archives cannot address anything past 4 GiB
+    if (!toExtended && dataEnd + directory.size() > UINT32_MAX) {
+        ok = false;
+    }
+    char header[WAD_EXTENDED_HEADER_SIZE] = {0};
+    std::memcpy(header, magic.c_str(), 4);
+    if (toExtended) {
+        uint32_t flags = compress ? WAD_FLAG_COMPRESSED : 0;
+        std::memcpy(header + 4, &flags, 4);
+        std::memcpy(header + 8, &count, 8);
+        std::memcpy(header + 16, &dataEnd, 8);
+    } else {
+        uint32_t classicCount = static_cast<uint32_t>(count);
+        uint32_t classicOffset = static_cast<uint32_t>(dataEnd);
+        std::memcpy(header + 4, &classicCount, 4);
+        std::memcpy(header + 8, &classicOffset, 4);
+    }
+    ok = ok && pwrite(out, directory.data(), directory.size(), dataEnd) == static_cast<ssize_t>(directory.size());
+    ok = ok && pwrite(out, header, headerSize, 0) == static_cast<ssize_t>(headerSize);
+    close(out);
+    if (!ok) {
+        unlink(path.c_str());
+    }
+    return ok;
+}
+
 Node* Wad::dfs(Node* current, const std::vector<std::string>& pathParts, size_t index) {
     if (!current) {
         return nullptr;
@@ -83,14 +527,11 @@ Node* Wad::dfs(Node* current, const std::vector<std::string>& pathParts, size_t
     }
 
     for (Node* child : current->children) {
-        std::string childName = child->filename;
         // _START and _END are not part of file names, strip if _START, ignore if _END
-        if (!child->isFile && childName.size() >= 6 && childName.substr(childName.size() - 6) == "_START") {
-            childName = childName.substr(0, childName.size() - 6);
-        }
-        if (!child->isFile &&childName.size() >= 4 && childName.substr(childName.size() - 4) == "_END") {
+        if (!child->isFile && WadNames::isNamespaceEnd(child->filename)) {
             continue;
         }
+        std::string_view childName = child->isFile ? std::string_view(child->filename) : WadNames::pathName(child->filename);
         if (childName == pathParts[index]) {
             return dfs(child, pathParts, index + 1);
         }
@@ -99,6 +540,114 @@ Node* Wad::dfs(Node* current, const std::vector<std::string>& pathParts, size_t
     return nullptr;
 }
 
+// name a node is reached by, _START stripped, empty for _END markers which are never reached
+static std::string_view pathName(const Node* node) {
+    if (node->isFile) {
+        return node->filename;
+    }
+    return WadNames::isNamespaceEnd(node->filename) ? std::string_view() : WadNames::pathName(node->filename);
+}
+
+static bool isMapMarker(const std::string &name) {
+    return WadNames::isMapMarker(name);
+}
+
+static bool isEndMarker(const Node* node) {
+    return !node->isFile && WadNames::isNamespaceEnd(node->filename);
+}
+
+// recomputes fullPath the way the Node constructor does, for a node and everything under it
+static void assignPaths(Node* node) {
+    std::string_view name = node->isFile ? std::string_view(node->filename) : WadNames::pathName(node->filename);
+    node->fullPath = node->parent->parent ? node->parent->fullPath : "";
+    node->fullPath += "/";
+    node->fullPath += name;
+    for (Node* child : node->children) {
+        assignPaths(child);
+    }
+}
+
+static void detach(Node* node) {
+    std::vector<Node*>& siblings = node->parent->children;
+    siblings.erase(std::find(siblings.begin(), siblings.end(), node));
+}
+
+// adds node under parent, in front of the parent's _END if it has one
+static void attach(Node* parent, Node* node) {
+    node->parent = parent;
+    std::vector<Node*>& siblings = parent->children;
+    if (!siblings.empty() && isEndMarker(siblings.back())) {
+        siblings.insert(siblings.end() - 1, node);
+    } else {
+        siblings.push_back(node);
+    }
+}
+
+// the next non-empty component of path from start on, empty at the end
+static std::string_view nextPart(std::string_view path, size_t &start) {
+    while (start < path.size()) {
+        size_t end = path.find('/', start);
+        if (end == std::string_view::npos) {
+            end = path.size();
+        }
+        std::string_view part = path.substr(start, end - start);
+        start = end + 1;
+        if (!part.empty()) {
+            return part;
+        }
+    }
+    return std::string_view();
+}
+
+static Node* findChild(Node* directory, std::string_view part) {
+    for (Node* child : directory->children) {
+        if (pathName(child) == part) {
+            return child;
+        }
+    }
+    return nullptr;
+}
+
+// same walk as split + dfs, one component at a time straight out of the caller's buffer
+// each directory is locked shared only while its children are searched, nodes are never freed
+// under a concurrent create or write, so the result stays valid once the locks are gone
+Node* Wad::lookup(std::string_view path) {
+    Node* current = root;
+    size_t start = 0;
+    for (std::string_view part = nextPart(path, start); current && !part.empty(); part = nextPart(path, start)) {
+        std::shared_lock<std::shared_mutex> lock(current->lock);
+        current = findChild(current, part);
+    }
+    return current;
+}
+
+Wad::PathLock::~PathLock() {
+    if (exclusive) {
+        exclusive->unlock();
+    }
+    for (auto it = shared.rbegin(); it != shared.rend(); ++it) {
+        (*it)->unlock_shared();
+    }
+}
+
+// the walk of lookup keeping every directory on the way locked shared and the node it ends at
+// locked exclusive, null if the path does not exist
+Node* Wad::lockPath(std::string_view path, PathLock &held) {
+    Node* current = root;
+    size_t start = 0;
+    for (std::string_view part = nextPart(path, start); !part.empty(); part = nextPart(path, start)) {
+        current->lock.lock_shared();
+        held.shared.push_back(&current->lock);
+        current = findChild(current, part);
+        if (!current) {
+            return nullptr;
+        }
+    }
+    current->lock.lock();
+    held.exclusive = &current->lock;
+    return current;
+}
+
 std::vector<std::string> Wad::split(const std::string &path) {
     std::vector<std::string> parts;
     std::stringstream ss(path);
@@ -111,89 +660,245 @@ std::vector<std::string> Wad::split(const std::string &path) {
     return parts;
 }
 
-bool Wad::isContent(const std::string &path) {
+bool Wad::isContent(std::string_view path) {
+    WadStatsTimer timer(WadStats::Lookup);
+    WadStats::add(WadStats::Lookups);
     // check if last character is "/", return false if true
-    if (path.empty() || path[-1] == '/') {
+    if (path.empty() || path.back() == '/') {
         return false;
     }
-    std::vector<std::string> pathParts = split(path);
-    Node* targetNode = dfs(root, pathParts, 0);
+    Node* targetNode = lookup(path);
     return targetNode && targetNode->isFile;
 }
 
-bool Wad::isDirectory(const std::string &path) {
-    // check if last character is "/", remove if true
-    std::string newPath = path;
-    if (newPath.empty()) {
+bool Wad::isDirectory(std::string_view path) {
+    WadStatsTimer timer(WadStats::Lookup);
+    WadStats::add(WadStats::Lookups);
+    // a trailing "/" is an empty component, lookup skips it
+    if (path.empty()) {
         return false;
     }
-    if (newPath[-1] == '/') {
-        newPath = newPath.erase(newPath.length() - 1);
-    }
-    std::vector<std::string> pathParts = split(newPath);
-    Node* targetNode = dfs(root, pathParts, 0);
+    Node* targetNode = lookup(path);
     return targetNode && !targetNode->isFile;
 }
 
-int Wad::getSize(const std::string &path) {
-    std::vector<std::string> pathParts = split(path);
-    Node* targetNode = dfs(root, pathParts, 0);
+off_t Wad::getSize(std::string_view path) {
+    WadStatsTimer timer(WadStats::Lookup);
+    WadStats::add(WadStats::Lookups);
+    return getSize(lookup(path));
+}
+
+off_t Wad::getSize(Node* targetNode) {
     if (!targetNode || !targetNode->isFile) {
         return -1;
     }
+    std::shared_lock<std::shared_mutex> lock(targetNode->lock);
     return targetNode->length;
 }
 
-int Wad::getContents(const std::string &path, char *buffer, int length, int offset) {
-    fileStream.open(filePath, std::ios::in | std::ios::out | std::ios::binary);
-    std::vector<std::string> pathParts = split(path);
-    Node* targetNode = dfs(root, pathParts, 0);
-    if (!targetNode || !targetNode->isFile) {
+ssize_t Wad::getContents(std::string_view path, char *buffer, size_t length, off_t offset) {
+    return getContents(lookup(path), buffer, length, offset);
+}
+
+ssize_t Wad::getContents(Node* targetNode, char *buffer, size_t length, off_t offset) {
+    WadStatsTimer timer(WadStats::GetContents);
+    WadTraceScope span("Wad::getContents");
+    if (!targetNode || !targetNode->isFile || offset < 0) {
         return -1;
     }
-    if (offset > targetNode->length) {
+    std::shared_lock<std::shared_mutex> lock(targetNode->lock);
+    if (static_cast<uint64_t>(offset) >= targetNode->length) {
         return 0;
     }
-    else {
-        fileStream.seekg(targetNode->offset + offset, std::ios::beg);
-        fileStream.read(buffer, std::min(length, static_cast<int>(targetNode->length) - offset));
+    ssize_t bytesRead = readExtent(targetNode->offset, targetNode->length, buffer, std::min<uint64_t>(length, targetNode->length - offset), offset);
+    WadStats::add(WadStats::BytesRead, bytesRead > 0 ? bytesRead : 0);
+    return bytesRead < 0 ? -1 : bytesRead;
+}
+
+// reads size bytes at position of the lump stored at offset with raw length, decompressing if needed
+ssize_t Wad::readExtent(uint64_t offset, uint64_t length, char *buffer, size_t size, uint64_t position) {
+    if (!compressed) {
+        return pread(fd, buffer, size, offset + position);
+    }
+    std::lock_guard<std::mutex> lock(cacheLock);
+    size_t copied = 0;
+    while (copied < size && position + copied < length) {
+        uint64_t block = (position + copied) / WAD_BLOCK_SIZE;
+        const std::vector<char>* raw = readBlock(offset, length, block);
+        if (!raw) {
+            return -1;
+        }
+        size_t within = position + copied - block * WAD_BLOCK_SIZE;
+        size_t take = std::min<uint64_t>(size - copied, raw->size() - within);
+        std::memcpy(buffer + copied, raw->data() + within, take);
+        copied += take;
     }
-    fileStream.flush();
-    fileStream.close();
-    return std::min(length, static_cast<int>(targetNode->length) - offset);
+    return copied;
 }
 
-int Wad::getDirectory(const std::string &path, std::vector<std::string> *directory) {
-    std::string newPath = path;
-    if (newPath.empty()) {
+// only the blocks a read touches are decompressed, recently used ones stay cached
+const std::vector<char>* Wad::readBlock(uint64_t offset, uint64_t length, uint64_t block) {
+    // blobs are at least 8 bytes per block long, so offset + block never collides between lumps
+    uint64_t key = offset + block;
+    auto cached = blockCache.find(key);
+    if (cached != blockCache.end()) {
+        blockRecent.splice(blockRecent.begin(), blockRecent, cached->second.recent);
+        return &cached->second.data;
+    }
+    WadTraceScope span("block decompress");
+    auto index = blockIndexes.find(offset);
+    if (index == blockIndexes.end()) {
+        std::vector<uint64_t> ends(WadCodec::blockCount(length));
+        size_t indexBytes = ends.size() * sizeof(uint64_t);
+        if (pread(fd, ends.data(), indexBytes, offset) != static_cast<ssize_t>(indexBytes)) {
+            return nullptr;
+        }
+        blockIndexBytes += indexBytes + 4 * sizeof(void*);
+        index = blockIndexes.emplace(offset, std::move(ends)).first;
+    }
+    const std::vector<uint64_t>& ends = index->second;
+    uint64_t start = block ? ends[block - 1] : 0;
+    if (block >= ends.size() || ends[block] < start) {
+        return nullptr;
+    }
+    std::vector<char> stored(ends[block] - start);
+    if (pread(fd, stored.data(), stored.size(), offset + WadCodec::indexSize(length) + start) != static_cast<ssize_t>(stored.size())) {
+        return nullptr;
+    }
+    std::vector<char> raw(std::min<uint64_t>(WAD_BLOCK_SIZE, length - block * WAD_BLOCK_SIZE));
+    if (!WadCodec::decodeBlock(stored.data(), stored.size(), raw.data(), raw.size())) {
+        return nullptr;
+    }
+    blockRecent.push_front(key);
+    blockCacheUsed += raw.size();
+    CachedBlock& entry = blockCache[key];
+    entry.data = std::move(raw);
+    entry.recent = blockRecent.begin();
+    // the block being returned is never the victim
+    while (blockCacheUsed > blockCacheLimit && blockRecent.back() != key) {
+        auto victim = blockCache.find(blockRecent.back());
+        blockCacheUsed -= victim->second.data.size();
+        blockCache.erase(victim);
+        blockRecent.pop_back();
+    }
+    return &entry.data;
+}
+
+int Wad::getDirectory(std::string_view path, std::vector<std::string> *directory) {
+    WadStatsTimer timer(WadStats::GetDirectory);
+    WadTraceScope span("Wad::getDirectory");
+    if (path.empty()) {
         return -1;
     }
-    if (newPath[-1] == '/') {
-        newPath = newPath.erase(newPath.length() - 1);
-    }  
-    std::vector<std::string> pathParts = split(newPath);
-    Node* dirNode = dfs(root, pathParts, 0);
+    Node* dirNode = lookup(path);
 
     if (!dirNode || dirNode->isFile) {
         return -1;
     }
 
+    std::shared_lock<std::shared_mutex> lock(dirNode->lock);
     for (Node* child : dirNode->children) {
-        if (child->filename.size() >= 4 && child->filename.substr(child->filename.size() - 4) == "_END") {
-            continue;
-        }
-        else if (child->filename.size() >= 6 && child->filename.substr(child->filename.size() - 6) == "_START") {
-            directory->push_back(child->filename.substr(0, child->filename.size() - 6));
-        }
-        else {
-            directory->push_back(child->filename);
+        if (!isEndMarker(child)) {
+            directory->emplace_back(pathName(child));
         }
     }
 
     return directory->size();
 }
 
-void Wad::createDirectory(const std::string &path) {
+// table index new entries under parent are inserted at: in front of its _END, after the last
+// descendant if it has none, or at the end of the table for the root
+uint64_t Wad::insertPosition(Node* parent) {
+    if (parent == root) {
+        return numDescriptor;
+    }
+    Node* last = parent;
+    while (!last->children.empty()) {
+        last = last->children.back();
+    }
+    if (last != parent && last->parent == parent && isEndMarker(last)) {
+        return last->index;
+    }
+    return last->index + 1;
+}
+
+// whether a lump called name at position would be read back as one of the map in front of it
+bool Wad::joinsMap(uint64_t position, std::string_view name) {
+    while (position > 0 && !descriptors[position - 1]) {
+        position--;
+    }
+    if (position == 0) {
+        return false;
+    }
+    Node* previous = descriptors[position - 1];
+    Node* map = isMapMarker(previous->filename) ? previous : previous->parent;
+    if (!map || !isMapMarker(map->filename)) {
+        return false;
+    }
+    int rank = -1;
+    for (Node* child : map->children) {
+        rank = WadNames::nextMapRank(rank, child->filename);
+    }
+    return WadNames::nextMapRank(rank, name) >= 0;
+}
+
+// writes descriptors for nodes at position, shifting the rest of the table down behind them
+// the tail is encoded from the nodes, which also drops any tombstones in it
+// the table grows in place into its slack or while it still ends the file, once an append took
+// the space behind it the whole table moves past that append instead
+bool Wad::insertDescriptors(uint64_t position, const std::vector<Node*> &nodes) {
+    // kept to put the table back when the header cannot name the new one
+    std::vector<Node*> tail(descriptors.begin() + position, descriptors.end());
+    uint64_t kept = tombstones;
+    uint64_t tableEnd = directoryOffset + rewrittenCount(position, nodes.size()) * descriptorSize();
+    uint64_t limit = tableLimit;
+    uint64_t oldOffset = 0, oldSize = 0;
+    bool moved = false;
+    if (tableEnd <= tableLimit || fileEnd.compare_exchange_strong(limit, tableEnd)) {
+        WadTraceScope span("tail rewrite");
+        tableLimit = std::max(tableLimit, tableEnd);
+        if (!rewriteTable(position, nodes, directoryOffset)) {
+            writeEntries(directoryOffset + position * descriptorSize(), tail.data(), tail.size());
+            return false;
+        }
+    } else {
+        WadTraceScope span("directory relocation");
+        if (!moveTable(position, nodes, oldOffset, oldSize)) {
+            return false;
+        }
+        moved = true;
+    }
+    // update header
+    WadTraceScope span("header update");
+    if (!writeHeader()) {
+        // the file still names the old table, memory goes back to it
+        descriptors.resize(position);
+        descriptors.insert(descriptors.end(), tail.begin(), tail.end());
+        for (uint64_t i = position; i < descriptors.size(); ++i) {
+            if (descriptors[i]) {
+                descriptors[i]->index = i;
+            }
+        }
+        tombstones = kept;
+        numDescriptor = descriptors.size();
+        namesIndexed = false;
+        if (moved) {
+            releaseRange(directoryOffset, tableLimit - directoryOffset);
+            directoryOffset = oldOffset;
+            tableLimit = oldOffset + oldSize;
+        } else {
+            writeEntries(directoryOffset + position * descriptorSize(), tail.data(), tail.size());
+        }
+        writeHeader();
+        return false;
+    }
+    releaseRange(oldOffset, oldSize);
+    return true;
+}
+
+Node* Wad::createDirectory(const std::string &path) {
+    WadStatsTimer timer(WadStats::CreateDirectory);
+    WadTraceScope span("Wad::createDirectory");
     // update data structure
     // read path backwards until first "/"
     // dfs tree until parent directory's end ex f1_end
@@ -216,81 +921,40 @@ void Wad::createDirectory(const std::string &path) {
         newDirName = newPath;
     }
     // name too long
-    if (newDirName.length() > 2) {
-        return;
+    if (newDirName.length() > 2 || readOnly) {
+        return nullptr;
     }
-    std::vector<std::string> pathParts = split(parentDir);
-    Node* parentNode = dfs(root, pathParts, 0);
-    if (!parentNode || (parentNode->filename[0] == 'E' && isdigit(parentNode->filename[1]) && parentNode->filename[2] == 'M' && isdigit(parentNode->filename[3]))) {
-        return;
+    // the parent stays locked exclusive until its new children are in the table
+    PathLock held;
+    Node* parentNode = lockPath(parentDir, held);
+    if (!parentNode || parentNode->isFile || isMapMarker(parentNode->filename)) {
+        return nullptr;
     }
-    Node* newDirStart = new Node(newDirName + "_START", false, 0, 0, parentNode);
-    Node* newDirEnd = new Node(newDirName + "_END", false, 0, 0, parentNode);
-    Node* endNode;
-    if (!parentNode->children.empty() && parentNode->children.back()->filename.substr(parentNode->children.back()->filename.length() - 4, parentNode->children.back()->filename.length()) == "_END") {
-        Node* endNode = parentNode->children[parentNode->children.size()-1];
-        parentNode->children.pop_back();
-        parentNode->children.push_back(newDirStart);
-        parentNode->children.push_back(newDirEnd);
-        parentNode->children.push_back(endNode);
-    }
-    else {
-        parentNode->children.push_back(newDirStart);
-        parentNode->children.push_back(newDirEnd);
+    if (Node* existing = findChild(parentNode, newDirName)) {
+        return existing;
     }
+    Node* newDirStart = new Node(newDirName + "_START", false, 0, 0, parentNode);
+    // the _END lives under its _START, same shape the loader builds
+    Node* newDirEnd = new Node(newDirName + "_END", false, 0, 0, newDirStart);
+    newDirStart->children.push_back(newDirEnd);
     // write to wad
-    fileStream.open(filePath, std::ios::in | std::ios::out | std::ios::binary);
-    fileStream.seekg(directoryOffset, std::ios::beg);
-    uint32_t parentEndOffset = 0;
-    char descriptor[16];
-    for (uint32_t i = 0; i < numDescriptor; ++i) {
-        fileStream.read(descriptor, 16);
-        std::string descriptorName(descriptor + 8, 8);
-        size_t nullPos = descriptorName.find('\0');
-        if (nullPos != std::string::npos) descriptorName.erase(nullPos);
-        if (parentNode->filename == "/" || (descriptorName == parentNode->filename.substr(0, parentNode->filename.length() - 6) + "_END")) {
-            parentEndOffset = directoryOffset + i * 16;
-            break;
-        }
-    }
-    fileStream.seekg(parentEndOffset, std::ios::beg);
-    std::vector<char> buffer((numDescriptor - ((parentEndOffset - directoryOffset) / 16)) * 16);
-    fileStream.read(buffer.data(), buffer.size());
-
-    uint32_t newOffset = 0;
-    uint32_t newLength = 0;
-    char startDescriptor[16] = {0};
-    std::memcpy(startDescriptor, &newOffset, 4);
-    std::memcpy(startDescriptor + 4, &newLength, 4);
-    std::memcpy(startDescriptor + 8, (newDirName + "_START").c_str(), (newDirName + "_START").size());
-    char endDescriptor[16] = {0};
-    std::memcpy(endDescriptor, &newOffset, 4);
-    std::memcpy(endDescriptor + 4, &newLength, 4);
-    std::memcpy(endDescriptor + 8, (newDirName + "_END").c_str(), (newDirName + "_END").size());
-
-    if (parentNode->filename == "/") {
-        fileStream.seekp(parentEndOffset, std::ios::beg);
-        fileStream.write(buffer.data(), buffer.size());
-        fileStream.write(startDescriptor, 16);
-        fileStream.write(endDescriptor, 16);
-    }
-    else {
-        fileStream.seekp(parentEndOffset, std::ios::beg);
-        fileStream.write(startDescriptor, 16);
-        fileStream.write(endDescriptor, 16);
-        fileStream.write(buffer.data(), buffer.size());
+    std::lock_guard<std::mutex> table(tableLock);
+    if (!insertDescriptors(insertPosition(parentNode), {newDirStart, newDirEnd})) {
+        delete newDirEnd;
+        delete newDirStart;
+        return nullptr;
     }
-    // update header
-    numDescriptor += 2;
-    fileStream.seekp(4, std::ios::beg);
-    fileStream.write(reinterpret_cast<const char*>(&numDescriptor), 4);
-    fileStream.flush();
-    fileStream.close();
+    attach(parentNode, newDirStart);
+    treeBytes += nodeBytes(newDirStart) + nodeBytes(newDirEnd);
+    WadStats::add(WadStats::DescriptorRewrites);
+    return newDirStart;
 }
 
-void Wad::createFile(const std::string &path) {
-    if (path.empty() || (path.length() >= 4 && path.substr(path.length() - 4) == "_END") || (path.length() >= 6 && path.substr(path.length() - 6) == "_START")) {
-        return;
+Node* Wad::createFile(const std::string &path) {
+    WadStatsTimer timer(WadStats::CreateFile);
+    WadTraceScope span("Wad::createFile");
+    if (path.empty()) {
+        return nullptr;
     }
     size_t pos = path.find_last_of('/');
     std::string parentDir;
@@ -303,122 +967,979 @@ void Wad::createFile(const std::string &path) {
         parentDir = "/";
         newFileName = path;
     }
-    // name too long
-    if (newFileName.length() > 8 || (newFileName[0] == 'E' && isdigit(newFileName[1]) && newFileName[2] == 'M' && isdigit(newFileName[3])) || (parentDir[0] == 'E' && isdigit(parentDir[1]) && parentDir[2] == 'M' && isdigit(parentDir[3]))) {
-        return;
+    // name too long, or one the loader would read back as a marker
+    if (newFileName.empty() || newFileName.length() > 8 || WadNames::classify(newFileName) != WadNameKind::Lump || readOnly) {
+        return nullptr;
     }
-    std::vector<std::string> pathParts = split(parentDir);
-    Node* parentNode = dfs(root, pathParts, 0);
-    if (!parentNode || (parentNode->filename[0] == 'E' && isdigit(parentNode->filename[1]) && parentNode->filename[2] == 'M' && isdigit(parentNode->filename[3]))) {
-        return;
+    PathLock held;
+    Node* parentNode = lockPath(parentDir, held);
+    if (!parentNode || parentNode->isFile || isMapMarker(parentNode->filename)) {
+        return nullptr;
     }
-    Node* newFile = new Node(newFileName, true, 0, 0, parentNode);
-    Node* endNode;
-    if (!parentNode->children.empty() && parentNode->children.back()->filename.substr(parentNode->children.back()->filename.length() - 4, parentNode->children.back()->filename.length()) == "_END") {
-        Node* endNode = parentNode->children[parentNode->children.size()-1];
-        parentNode->children.pop_back();
-        parentNode->children.push_back(newFile);
-        parentNode->children.push_back(endNode);
+    if (Node* existing = findChild(parentNode, newFileName)) {
+        return existing;
     }
-    else {
-        parentNode->children.push_back(newFile);
+    std::lock_guard<std::mutex> table(tableLock);
+    uint64_t position = insertPosition(parentNode);
+    // right behind a map's last lump a map lump name that continues its order would be read back
+    // as part of that map
+    if (joinsMap(position, newFileName)) {
+        return nullptr;
     }
-    fileStream.open(filePath, std::ios::in | std::ios::out | std::ios::binary);
+    Node* newFile = new Node(newFileName, true, 0, 0, parentNode);
     // write to wad
-    fileStream.seekg(directoryOffset, std::ios::beg);
-    uint32_t parentEndOffset = 0;
-    char descriptor[16];
-    for (uint32_t i = 0; i < numDescriptor; ++i) {
-        fileStream.read(descriptor, 16);
-        std::string descriptorName(descriptor + 8, 8);
-        size_t nullPos = descriptorName.find('\0');
-        if (nullPos != std::string::npos) descriptorName.erase(nullPos);
-        if (parentNode->filename == "/" || (descriptorName == parentNode->filename.substr(0, parentNode->filename.length() - 6) + "_END")) {
-            parentEndOffset = directoryOffset + i * 16;
-            break;
+    if (!insertDescriptors(position, {newFile})) {
+        delete newFile;
+        return nullptr;
+    }
+    attach(parentNode, newFile);
+    treeBytes += nodeBytes(newFile);
+    WadStats::add(WadStats::DescriptorRewrites);
+    return newFile;
+}
+
+void Wad::setDeduplication(bool enabled) {
+    deduplicate = enabled;
+}
+
+// multiply-rotate mix over 8 byte words, seeded with the length so only equal sized lumps collide
+// it only has to spread well, every candidate is compared byte for byte before it is reused
+static uint64_t mixWord(uint64_t hash, uint64_t word) {
+    hash ^= word * 0x87C37B91114253D5ULL;
+    hash = (hash << 31) | (hash >> 33);
+    return hash * 0x9E3779B97F4A7C15ULL;
+}
+
+// size must be a multiple of 8 except on the last call
+static uint64_t hashBytes(uint64_t hash, const char *data, size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = mixWord(hash, word);
+    }
+    if (i < size) {
+        uint64_t word = 0;
+        std::memcpy(&word, data + i, size - i);
+        hash = mixWord(hash, word);
+    }
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// hashes every lump already in the archive, done once on the first deduplicating write
+void Wad::buildContentIndex() {
+    WadTraceScope span("content index build");
+    contentIndexed = true;
+    std::vector<char> chunk(1 << 20);
+    for (Node* node : descriptors) {
+        if (!node || !node->isFile || node->length == 0) {
+            continue;
+        }
+        uint64_t hash = node->length;
+        bool ok = true;
+        for (uint64_t done = 0; done < node->length && ok; ) {
+            size_t n = std::min<uint64_t>(chunk.size(), node->length - done);
+            ok = readExtent(node->offset, node->length, chunk.data(), n, done) == static_cast<ssize_t>(n);
+            hash = hashBytes(hash, chunk.data(), n);
+            done += n;
+        }
+        if (!ok) {
+            continue;
+        }
+        // lumps that already share an extent are indexed once
+        bool known = false;
+        auto range = contentIndex.equal_range(hash);
+        for (auto it = range.first; it != range.second && !known; ++it) {
+            known = it->second.first == node->offset && it->second.second == node->length;
+        }
+        if (!known) {
+            contentIndex.emplace(hash, std::make_pair(node->offset, node->length));
         }
     }
-    fileStream.seekg(parentEndOffset, std::ios::beg);
-    std::vector<char> buffer((numDescriptor - ((parentEndOffset - directoryOffset) / 16)) * 16);
-    fileStream.read(buffer.data(), buffer.size());
+}
 
-    uint32_t newOffset = 0;
-    uint32_t newLength = 0;
-    char newFileDescriptor[16] = {0};
-    std::memcpy(newFileDescriptor, &newOffset, 4);
-    std::memcpy(newFileDescriptor + 4, &newLength, 4);
-    std::memcpy(newFileDescriptor + 8, (newFileName).c_str(), (newFileName).size());
+bool Wad::findDuplicate(uint64_t hash, const char *buffer, size_t length, uint64_t &offset) {
+    std::vector<char> existing;
+    auto range = contentIndex.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second.second != length) {
+            continue;
+        }
+        existing.resize(length);
+        if (readExtent(it->second.first, length, existing.data(), length, 0) == static_cast<ssize_t>(length) && std::memcmp(existing.data(), buffer, length) == 0) {
+            offset = it->second.first;
+            return true;
+        }
+    }
+    return false;
+}
 
-    if (parentNode->filename == "/") {
-        fileStream.seekp(parentEndOffset, std::ios::beg);
-        fileStream.write(buffer.data(), buffer.size());
-        fileStream.write(newFileDescriptor, 16);
+ssize_t Wad::writeToFile(const std::string &path, const char *buffer, size_t length, off_t offset) {
+    if (path.empty() || path.back() == '/' || readOnly) {
+        return -1;
     }
-    else {
-        fileStream.seekp(parentEndOffset, std::ios::beg);
-        fileStream.write(newFileDescriptor, 16);
-        fileStream.write(buffer.data(), buffer.size());
+    PathLock held;
+    Node* targetNode = lockPath(path, held);
+    if (!targetNode || !targetNode->isFile) {
+        return -1;
     }
-    // update header
-    numDescriptor += 1;
-    fileStream.seekp(4, std::ios::beg);
-    fileStream.write(reinterpret_cast<const char*>(&numDescriptor), 4);
-    fileStream.flush();
-    fileStream.close();
+    return writeLump(targetNode, buffer, length);
 }
 
-int Wad::writeToFile(const std::string &path, const char *buffer, int length, int offset) { 
-    if (!isContent(path)) {
+// a caller holding the node already walked its path, only the lump itself is locked
+ssize_t Wad::writeToFile(Node* targetNode, const char *buffer, size_t length, off_t offset) {
+    if (!targetNode || !targetNode->isFile || readOnly) {
         return -1;
     }
-    std::vector<std::string> pathParts = split(path);
-    Node* targetNode = dfs(root, pathParts, 0);
+    std::unique_lock<std::shared_mutex> lock(targetNode->lock);
+    return writeLump(targetNode, buffer, length);
+}
+
+// stores the bytes of an empty lump, its lock is held exclusive
+// compression and the data write run unlocked in space from allocateExtent or reserve, the
+// descriptor is committed under tableLock
+// a lump may land behind the table, only the extent in its descriptor changes and the header stays
+ssize_t Wad::writeLump(Node* targetNode, const char *buffer, size_t length) {
+    WadStatsTimer timer(WadStats::WriteToFile);
+    WadTraceScope span("Wad::writeToFile");
     if (targetNode->length > 0) {
         return 0;
     }
+    uint64_t hash = 0;
+    if (deduplicate && length > 0) {
+        WadTraceScope span("dedup lookup");
+        std::lock_guard<std::mutex> table(tableLock);
+        if (!contentIndexed) {
+            buildContentIndex();
+        }
+        hash = hashBytes(length, buffer, length);
+        uint64_t existing;
+        if (findDuplicate(hash, buffer, length, existing)) {
+            // same bytes are already stored, only the descriptor changes
+            char descriptor[24] = {0};
+            encodeExtent(descriptor, existing, length);
+            if (!writeAt(descriptor, descriptorSize() - 8, directoryOffset + targetNode->index * descriptorSize())) {
+                return -1;
+            }
+            targetNode->offset = existing;
+            targetNode->length = length;
+            WadStats::add(WadStats::BytesDeduplicated, length);
+            return length;
+        }
+    }
+    // compressed archives store the encoded blob, the descriptor still gets the raw length
+    const char *stored = buffer;
+    size_t storedLength = length;
+    std::vector<char> blob;
+    if (compressed && length > 0) {
+        WadTraceScope span("compress");
+        if (!WadCodec::encode(buffer, length, &blob)) {
+            return -1;
+        }
+        stored = blob.data();
+        storedLength = blob.size();
+    }
+    // space released by removes and truncates first, then the end of the file
+    // classic offsets are 32-bit, reserve refuses instead of wrapping around
+    uint64_t lumpEnd;
+    bool reused = storedLength > 0 && allocateExtent(storedLength, targetNode->fullPath, lumpEnd);
+    if (!reused && !reserve(storedLength, lumpEnd)) {
+        return -1;
+    }
+    // the mapping moves when it grows, so mapped writes copy under the table lock as well
+    std::unique_lock<std::mutex> table(tableLock, std::defer_lock);
+    if (mappedWrites) {
+        table.lock();
+    }
     // write to end of lump data
-    fileStream.open(filePath, std::ios::in | std::ios::out | std::ios::binary);
-    fileStream.seekp(0, std::ios::end);
-    uint32_t lumpEnd = static_cast<uint32_t>(fileStream.tellp());
-    fileStream.write(buffer, length);
+    bool written;
+    {
+        WadTraceScope span("lump write");
+        written = writeAt(stored, storedLength, lumpEnd);
+    }
+    if (!table.owns_lock()) {
+        table.lock();
+    }
+    // the node is left empty, the space goes back to the free list
+    if (!written) {
+        releaseRange(lumpEnd, storedLength);
+        return -1;
+    }
+    WadStats::add(WadStats::BytesWritten, storedLength);
+    WadStats::add(WadStats::BytesReused, reused ? storedLength : 0);
+    if (deduplicate && length > 0) {
+        contentIndex.emplace(hash, std::make_pair(lumpEnd, static_cast<uint64_t>(length)));
+    }
+    // update descriptor, only its extent changes
+    {
+        WadTraceScope span("descriptor update");
+        char descriptor[24] = {0};
+        encodeExtent(descriptor, lumpEnd, length);
+        if (!writeAt(descriptor, descriptorSize() - 8, directoryOffset + targetNode->index * descriptorSize())) {
+            // the lump stays empty, on disk as far as the file still takes writes
+            std::memset(descriptor, 0, sizeof(descriptor));
+            writeAt(descriptor, descriptorSize() - 8, directoryOffset + targetNode->index * descriptorSize());
+            releaseRange(lumpEnd, storedLength);
+            return -1;
+        }
+    }
     // update node;
     targetNode->offset = lumpEnd;
     targetNode->length = length;
-    // shift descriptor list
-    uint32_t newDirectoryOffset = static_cast<uint32_t>(fileStream.tellp());
-    uint32_t descriptorSize = numDescriptor * 16;
-    if (newDirectoryOffset + descriptorSize > directoryOffset) {
-        char *buffer = new char[descriptorSize];
-        fileStream.seekg(directoryOffset, std::ios::beg);
-        fileStream.read(buffer, descriptorSize);
-        fileStream.seekp(newDirectoryOffset, std::ios::beg);
-        fileStream.write(buffer, descriptorSize);
-        delete[] buffer;
-        directoryOffset = newDirectoryOffset;
-    }
-    // update descriptor
-    char descriptor[16] = {0};
-    fileStream.seekg(directoryOffset, std::ios::beg);
-    for (uint32_t i = 0; i < numDescriptor; ++i) {
-        fileStream.read(descriptor, 16);
-        std::string descriptorName(descriptor + 8, 8);
-        size_t nullPos = descriptorName.find('\0');
-        if (nullPos != std::string::npos) {
-            descriptorName.erase(nullPos);
-        }
-        if (descriptorName == targetNode->filename) {
-            fileStream.seekp(directoryOffset + (i * 16), std::ios::beg);
-            fileStream.write(reinterpret_cast<const char*>(&lumpEnd), 4);
-            fileStream.write(reinterpret_cast<const char*>(&length), 4);
-            fileStream.flush();
-            break;
+    return length;
+}
+
+// bytes the lump occupies in the file, the block index and compressed blocks for compressed archives
+uint64_t Wad::storedLength(Node* node) {
+    if (!compressed || node->length == 0) {
+        return node->length;
+    }
+    uint64_t lastEnd = 0;
+    bool indexed = false;
+    {
+        // readers add block indexes under the cache lock
+        std::lock_guard<std::mutex> cache(cacheLock);
+        auto index = blockIndexes.find(node->offset);
+        if (index != blockIndexes.end()) {
+            lastEnd = index->second.back();
+            indexed = true;
         }
     }
-    // update header
-    fileStream.seekp(8, std::ios::beg);
-    fileStream.write(reinterpret_cast<const char*>(&directoryOffset), 4);
-    fileStream.flush();
-    fileStream.close();
-    return length;
+    if (!indexed && pread(fd, &lastEnd, 8, node->offset + WadCodec::indexSize(node->length) - 8) != 8) {
+        return 0;
+    }
+    return WadCodec::indexSize(node->length) + lastEnd;
+}
+
+// deduplicated lumps share an extent, it is only released once nothing else points at it
+// a scan of the in-memory table, no reads
+bool Wad::isShared(Node* node) {
+    for (Node* other : descriptors) {
+        if (other && other != node && other->isFile && other->length > 0 && other->offset == node->offset) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Wad::releaseExtent(Node* node) {
+    if (node->length == 0 || isShared(node)) {
+        return;
+    }
+    uint64_t size = storedLength(node);
+    if (compressed) {
+        // the offset is about to be reused, cached blocks under it would be stale
+        for (uint64_t block = 0; block < WadCodec::blockCount(node->length); ++block) {
+            auto cached = blockCache.find(node->offset + block);
+            if (cached != blockCache.end()) {
+                blockCacheUsed -= cached->second.data.size();
+                blockRecent.erase(cached->second.recent);
+                blockCache.erase(cached);
+            }
+        }
+        auto index = blockIndexes.find(node->offset);
+        if (index != blockIndexes.end()) {
+            blockIndexBytes -= index->second.size() * sizeof(uint64_t) + 4 * sizeof(void*);
+            blockIndexes.erase(index);
+        }
+    }
+    vacate(node);
+    releaseRange(node->offset, size);
+}
+
+void Wad::vacate(Node* node) {
+    if (node->isFile && node->length > 0) {
+        std::lock_guard<std::mutex> lock(extentLock);
+        vacated.emplace(node->offset, node->fullPath);
+    }
+}
+
+void Wad::releaseRange(uint64_t offset, uint64_t size) {
+    if (size == 0) {
+        return;
+    }
+    for (auto it = checksums.begin(); it != checksums.end(); ) {
+        if (it->first < offset + size && it->first + it->second.first > offset) {
+            it = checksums.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    // drop dedup candidates overlapping the range, they are about to be overwritten
+    for (auto it = contentIndex.begin(); it != contentIndex.end(); ) {
+        if (it->second.first < offset + size && it->second.first + it->second.second > offset) {
+            it = contentIndex.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    std::lock_guard<std::mutex> lock(extentLock);
+    auto next = freeExtents.lower_bound(offset);
+    if (next != freeExtents.end() && offset + size == next->first) {
+        size += next->second;
+        next = freeExtents.erase(next);
+    }
+    if (next != freeExtents.begin()) {
+        auto previous = std::prev(next);
+        if (previous->first + previous->second == offset) {
+            previous->second += size;
+            return;
+        }
+    }
+    freeExtents.emplace(offset, size);
+}
+
+// first fit, skipping extents the same path left this session, the remainder stays free
+bool Wad::allocateExtent(uint64_t size, const std::string &path, uint64_t &offset) {
+    std::lock_guard<std::mutex> lock(extentLock);
+    for (auto it = freeExtents.begin(); it != freeExtents.end(); ++it) {
+        if (it->second < size) {
+            continue;
+        }
+        auto left = vacated.equal_range(it->first);
+        if (std::any_of(left.first, left.second, [&](const std::pair<const uint64_t, std::string> &entry) { return entry.second == path; })) {
+            continue;
+        }
+        offset = it->first;
+        uint64_t remaining = it->second - size;
+        freeExtents.erase(it);
+        if (remaining > 0) {
+            freeExtents.emplace(offset + size, remaining);
+        }
+        return true;
+    }
+    return false;
+}
+
+// bump allocation at the end of the file, a compare and swap so parallel appends never wait on
+// each other, false when classic 32-bit offsets cannot reach past it
+bool Wad::reserve(uint64_t size, uint64_t &offset) {
+    uint64_t end = fileEnd.load();
+    do {
+        if (!extended && end + size > UINT32_MAX) {
+            return false;
+        }
+    } while (!fileEnd.compare_exchange_weak(end, end + size));
+    offset = end;
+    return true;
+}
+
+// the file grows by at least this much at a time while mapped
+static const uint64_t mapGrowth = 64 << 20;
+
+bool Wad::mapFile() {
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        return false;
+    }
+    mappedSize = st.st_size;
+    if (mappedSize > 0) {
+        void* mapped = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            mappedSize = 0;
+            return false;
+        }
+        mapping = static_cast<char*>(mapped);
+    }
+    mappedWrites = true;
+    return true;
+}
+
+// gives the space grown ahead of the data back, unless another writer extended the file meanwhile
+// slack behind a table that ends the file goes as well
+void Wad::trimFile() {
+    uint64_t limit = tableLimit;
+    uint64_t tableEnd = directoryOffset + numDescriptor * descriptorSize();
+    if (tableEnd < limit && fileEnd.compare_exchange_strong(limit, tableEnd)) {
+        tableLimit = tableEnd;
+    }
+    struct stat st;
+    if (mappedSize <= fileEnd || fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) != mappedSize) {
+        return;
+    }
+    if (fileEnd == 0) {
+        munmap(mapping, mappedSize);
+        mapping = nullptr;
+    } else {
+        void* shrunk = mremap(mapping, mappedSize, fileEnd, 0);
+        if (shrunk == MAP_FAILED) {
+            return;
+        }
+        mapping = static_cast<char*>(shrunk);
+    }
+    mappedSize = fileEnd;
+    ftruncate(fd, fileEnd);
+}
+
+void Wad::unmapFile() {
+    flush();
+    if (mapping) {
+        munmap(mapping, mappedSize);
+    }
+    mapping = nullptr;
+    mappedSize = 0;
+    mappedWrites = false;
+    dirty.clear();
+}
+
+bool Wad::setMappedWrites(bool enabled) {
+    if (enabled == mappedWrites) {
+        return true;
+    }
+    if (enabled && readOnly) {
+        return false;
+    }
+    if (!enabled) {
+        unmapFile();
+        return true;
+    }
+    return mapFile();
+}
+
+// pointer to size bytes of the mapping at offset, growing the file first when they lie past it
+// marks the range dirty, null when not mapped or the file cannot grow
+char* Wad::writable(uint64_t offset, size_t size) {
+    if (!mappedWrites) {
+        return nullptr;
+    }
+    uint64_t end = offset + size;
+    if (end > mappedSize) {
+        // allocated rather than sparse, so a full disk fails here instead of faulting on a store
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        uint64_t grown = (end + std::max<uint64_t>(mappedSize, mapGrowth) + page - 1) / page * page;
+        if (fallocate(fd, 0, mappedSize, grown - mappedSize) != 0 && (errno != EOPNOTSUPP || ftruncate(fd, grown) != 0)) {
+            return nullptr;
+        }
+        void* mapped = mapping ? mremap(mapping, mappedSize, grown, MREMAP_MAYMOVE) : mmap(nullptr, grown, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            return nullptr;
+        }
+        mapping = static_cast<char*>(mapped);
+        mappedSize = grown;
+    }
+    // page aligned so msync can take the ranges as they are, touching ranges merge
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset / page * page;
+    end = std::min(mappedSize, (end + page - 1) / page * page);
+    auto next = dirty.upper_bound(start);
+    if (next != dirty.begin() && std::prev(next)->second >= start) {
+        --next;
+        start = next->first;
+        end = std::max(end, next->second);
+        next = dirty.erase(next);
+    }
+    while (next != dirty.end() && next->first <= end) {
+        end = std::max(end, next->second);
+        next = dirty.erase(next);
+    }
+    dirty.emplace(start, end);
+    return mapping + offset;
+}
+
+// false once the bytes cannot all be written, short writes and interrupted ones are retried
+bool Wad::writeAt(const void *data, size_t size, uint64_t offset) {
+    if (size == 0) {
+        return true;
+    }
+    if (char* out = writable(offset, size)) {
+        std::memcpy(out, data, size);
+        return true;
+    }
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+int Wad::flush() {
+    if (readOnly) {
+        return fd >= 0 ? 0 : -1;
+    }
+    if (!mappedWrites) {
+        return fd >= 0 && fdatasync(fd) == 0 ? 0 : -1;
+    }
+    int result = 0;
+    for (auto& range : dirty) {
+        if (msync(mapping + range.first, range.second - range.first, MS_SYNC) != 0) {
+            result = -1;
+        }
+    }
+    dirty.clear();
+    // at a commit the file ends where the archive does, for anyone else reading it
+    trimFile();
+    return result;
 }
 
+// drops a lump from the table and the tree, its extent becomes free space
+// false when its descriptor cannot be zeroed, nothing changed then
+bool Wad::removeNode(Node* node) {
+    if (!markTombstone(node)) {
+        return false;
+    }
+    dropNode(node);
+    return true;
+}
+
+// the in-memory half of removeNode, for a lump already tombstoned
+void Wad::dropNode(Node* node) {
+    releaseExtent(node);
+    detach(node);
+    treeBytes -= nodeBytes(node);
+    delete node;
+}
+
+int Wad::removeFile(const std::string &path) {
+    WadStatsTimer timer(WadStats::RemoveFile);
+    WadTraceScope span("Wad::removeFile");
+    Node* node = readOnly ? nullptr : lookup(path);
+    if (!node || !node->isFile || isMapMarker(node->parent->filename)) {
+        return -1;
+    }
+    return removeNode(node) ? 0 : -1;
+}
+
+int Wad::removeDirectory(const std::string &path) {
+    WadStatsTimer timer(WadStats::RemoveDirectory);
+    WadTraceScope span("Wad::removeDirectory");
+    Node* node = readOnly ? nullptr : lookup(path);
+    if (!node || node == root || node->isFile || isMapMarker(node->filename)) {
+        return -1;
+    }
+    // the _END marker is the only child an empty namespace has
+    for (Node* child : node->children) {
+        if (!isEndMarker(child)) {
+            return -1;
+        }
+    }
+    std::vector<Node*> markers(node->children);
+    markers.push_back(node);
+    if (!markTombstones(markers)) {
+        return -1;
+    }
+    treeBytes -= subtreeBytes(node);
+    for (Node* child : node->children) {
+        delete child;
+    }
+    detach(node);
+    delete node;
+    return 0;
+}
+
+int Wad::renamePath(const std::string &from, const std::string &to) {
+    WadStatsTimer timer(WadStats::RenamePath);
+    WadTraceScope span("Wad::renamePath");
+    Node* node = readOnly ? nullptr : lookup(from);
+    if (!node || node == root || isMapMarker(node->filename) || isMapMarker(node->parent->filename)) {
+        return -1;
+    }
+    std::string target = to;
+    if (!target.empty() && target.back() == '/') {
+        target.erase(target.length() - 1);
+    }
+    size_t pos = target.find_last_of('/');
+    std::string parentDir = pos == std::string::npos || pos == 0 ? "/" : target.substr(0, pos);
+    std::string newName = pos == std::string::npos ? target : target.substr(pos + 1);
+    // same naming rules as createFile and createDirectory
+    if (newName.empty() || newName.length() > (node->isFile ? 8 : 2) || WadNames::classify(newName) != WadNameKind::Lump) {
+        return -1;
+    }
+    Node* parentNode = lookup(parentDir);
+    if (!parentNode || parentNode->isFile || isMapMarker(parentNode->filename)) {
+        return -1;
+    }
+    // a namespace cannot move into itself
+    for (Node* ancestor = parentNode; ancestor; ancestor = ancestor->parent) {
+        if (ancestor == node) {
+            return -1;
+        }
+    }
+    Node* existing = lookup(target);
+    if (existing == node) {
+        return 0;
+    }
+    // same rule as createFile, a name must not land where it would join the map in front of it
+    uint64_t landing = parentNode == node->parent ? node->index : insertPosition(parentNode);
+    if (node->isFile && joinsMap(landing, newName)) {
+        return -1;
+    }
+    if (existing && (!existing->isFile || !node->isFile || isMapMarker(existing->parent->filename))) {
+        return -1;
+    }
+    // checked up front, nothing may change until the subtree is sure to fit back into the table
+    std::vector<Node*> moved;
+    std::function<void(Node*)> collect = [&](Node* current) {
+        moved.push_back(current);
+        for (Node* child : current->children) {
+            collect(child);
+        }
+    };
+    collect(node);
+    if (parentNode != node->parent && !tableRoom(moved.size())) {
+        return -1;
+    }
+    // the replaced lump is tombstoned up front, a failed write can still bring it back
+    if (existing && !markTombstone(existing)) {
+        return -1;
+    }
+    // the lumps keep their bytes but leave their paths
+    for (Node* current : moved) {
+        vacate(current);
+    }
+    Node* end = !node->children.empty() && isEndMarker(node->children.back()) ? node->children.back() : nullptr;
+    std::string oldName = node->filename;
+    std::string oldEnd = end ? end->filename : std::string();
+    // new names and paths take new strings
+    auto rename = [&](const std::string &name, const std::string &endName) {
+        treeBytes -= subtreeBytes(node);
+        node->filename = name;
+        if (end) {
+            end->filename = endName;
+        }
+        assignPaths(node);
+        treeBytes += subtreeBytes(node);
+    };
+    std::string startName = node->isFile ? newName : newName + "_START";
+    if (parentNode == node->parent) {
+        // the table position stays valid, only the names change
+        rename(startName, newName + "_END");
+        if (!writeDescriptor(node) || (end && !writeDescriptor(end))) {
+            rename(oldName, oldEnd);
+            writeDescriptor(node);
+            if (end) {
+                writeDescriptor(end);
+            }
+            if (existing) {
+                reviveTombstone(existing);
+            }
+            return -1;
+        }
+    } else {
+        // another directory means another table position: tombstone the subtree and insert it again
+        if (!markTombstones(moved)) {
+            if (existing) {
+                reviveTombstone(existing);
+            }
+            return -1;
+        }
+        // a failed insert leaves the table as it was, so the old indices are still good
+        std::vector<uint64_t> indices;
+        for (Node* current : moved) {
+            indices.push_back(current->index);
+        }
+        Node* oldParent = node->parent;
+        size_t slot = std::find(oldParent->children.begin(), oldParent->children.end(), node) - oldParent->children.begin();
+        detach(node);
+        uint64_t position = insertPosition(parentNode);
+        attach(parentNode, node);
+        rename(startName, newName + "_END");
+        WadStats::add(WadStats::DescriptorRewrites);
+        if (!insertDescriptors(position, moved)) {
+            detach(node);
+            node->parent = oldParent;
+            oldParent->children.insert(oldParent->children.begin() + slot, node);
+            rename(oldName, oldEnd);
+            for (size_t i = 0; i < moved.size(); ++i) {
+                moved[i]->index = indices[i];
+                reviveTombstone(moved[i]);
+            }
+            if (existing) {
+                reviveTombstone(existing);
+            }
+            return -1;
+        }
+    }
+    // the replaced lump goes only once the renamed one holds its name
+    if (existing) {
+        dropNode(existing);
+    }
+    return 0;
+}
+
+int Wad::truncateFile(const std::string &path, uint64_t length) {
+    WadStatsTimer timer(WadStats::TruncateFile);
+    WadTraceScope span("Wad::truncateFile");
+    Node* node = readOnly ? nullptr : lookup(path);
+    if (!node || !node->isFile || length > node->length) {
+        return -1;
+    }
+    if (length == node->length) {
+        return 0;
+    }
+    if (compressed && length > 0) {
+        // blocks cannot be cut in place, keep the prefix and store it again
+        std::vector<char> prefix(length);
+        if (readExtent(node->offset, node->length, prefix.data(), length, 0) != static_cast<ssize_t>(length)) {
+            return -1;
+        }
+        // the old blocks stay put until the prefix is stored, a failed write leaves the lump as it was
+        uint64_t oldOffset = node->offset;
+        uint64_t oldLength = node->length;
+        node->offset = 0;
+        node->length = 0;
+        bool stored = writeToFile(node, prefix.data(), length) == static_cast<ssize_t>(length);
+        std::swap(oldOffset, node->offset);
+        std::swap(oldLength, node->length);
+        if (stored) {
+            releaseExtent(node);
+            node->offset = oldOffset;
+            node->length = oldLength;
+        }
+        return stored ? 0 : -1;
+    }
+    // the descriptor goes first, a failed write leaves the lump as it was
+    char descriptor[24] = {0};
+    encodeExtent(descriptor, length == 0 ? 0 : node->offset, length);
+    if (!writeAt(descriptor, descriptorSize() - 8, directoryOffset + node->index * descriptorSize())) {
+        return -1;
+    }
+    if (length == 0) {
+        releaseExtent(node);
+        node->offset = 0;
+    } else if (!isShared(node)) {
+        releaseRange(node->offset + length, node->length - length);
+    }
+    node->length = length;
+    return 0;
+}
+
+bool Wad::getExtent(Node* node, WadExtent *extent) {
+    if (!node || !node->isFile) {
+        return false;
+    }
+    std::shared_lock<std::shared_mutex> lock(node->lock);
+    extent->filePath = filePath;
+    extent->offset = node->offset;
+    extent->length = node->length;
+    extent->stored = storedLength(node);
+    extent->compressed = compressed;
+    return true;
+}
+
+bool Wad::getChecksum(Node* node, uint32_t &crc) {
+    if (!node || !node->isFile) {
+        return false;
+    }
+    // a write replacing the lump waits, the bytes hashed stay the node's
+    std::shared_lock<std::shared_mutex> lock(node->lock);
+    uint64_t stored = storedLength(node);
+    {
+        std::lock_guard<std::mutex> table(tableLock);
+        auto cached = checksums.find(node->offset);
+        if (cached != checksums.end() && cached->second.first == stored) {
+            crc = cached->second.second;
+            return true;
+        }
+    }
+    std::vector<char> chunk(std::min<uint64_t>(stored, 1 << 20));
+    uint32_t value = 0;
+    for (uint64_t done = 0; done < stored; ) {
+        size_t n = std::min<uint64_t>(chunk.size(), stored - done);
+        if (pread(fd, chunk.data(), n, node->offset + done) != static_cast<ssize_t>(n)) {
+            return false;
+        }
+        value = WadVerify::crc32c(value, chunk.data(), n);
+        done += n;
+    }
+    if (stored > 0) {
+        std::lock_guard<std::mutex> table(tableLock);
+        checksums[node->offset] = std::make_pair(stored, value);
+    }
+    crc = value;
+    return true;
+}
+
+// what every match of pattern has in its packed name: the literal bytes in front of the first '*',
+// with '?' positions left open, and zero padding after the end when there is no '*' at all
+static void patternWord(std::string_view pattern, uint64_t &mask, uint64_t &value) {
+    mask = 0;
+    value = 0;
+    size_t i = 0;
+    for (; i < pattern.size() && i < 8 && pattern[i] != '*'; ++i) {
+        if (pattern[i] != '?') {
+            mask |= 0xFFULL << (8 * i);
+            value |= static_cast<uint64_t>(static_cast<uint8_t>(pattern[i])) << (8 * i);
+        }
+    }
+    if (i == pattern.size()) {
+        for (; i < 8; ++i) {
+            mask |= 0xFFULL << (8 * i);
+        }
+    }
+}
+
+static size_t scanWords(const uint64_t *words, size_t count, uint64_t mask, uint64_t value, std::vector<uint64_t> *hits, size_t i) {
+    for (; i < count; ++i) {
+        if ((words[i] & mask) == value) {
+            hits->push_back(i);
+        }
+    }
+    return i;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static size_t scanWordsAvx2(const uint64_t *words, size_t count, uint64_t mask, uint64_t value, std::vector<uint64_t> *hits) {
+    __m256i masks = _mm256_set1_epi64x(mask);
+    __m256i values = _mm256_set1_epi64x(value);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + i));
+        int bits = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(block, masks), values)));
+        while (bits) {
+            hits->push_back(i + __builtin_ctz(bits));
+            bits &= bits - 1;
+        }
+    }
+    return i;
+}
+#endif
+
+int Wad::findLumps(std::string_view pattern, std::vector<Node*> *matches) {
+    WadStatsTimer timer(WadStats::FindLumps);
+    WadTraceScope span("Wad::findLumps");
+    if (pattern.empty()) {
+        return -1;
+    }
+    // the packed names follow the table, a create committing meanwhile would change both
+    std::lock_guard<std::mutex> table(tableLock);
+    if (!namesIndexed) {
+        packedNames.resize(descriptors.size());
+        for (size_t i = 0; i < descriptors.size(); ++i) {
+            Node* node = descriptors[i];
+            packedNames[i] = node && node->isFile ? WadNames::pack(node->filename) : 0;
+        }
+        namesIndexed = true;
+    }
+    uint64_t mask, value;
+    patternWord(pattern, mask, value);
+    std::vector<uint64_t> hits;
+    size_t scanned = 0;
+#if defined(__x86_64__)
+    static bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) {
+        scanned = scanWordsAvx2(packedNames.data(), packedNames.size(), mask, value, &hits);
+    }
+#endif
+    scanWords(packedNames.data(), packedNames.size(), mask, value, &hits, scanned);
+    size_t before = matches->size();
+    // candidates are checked on the packed word, only real matches touch their node
+    for (uint64_t i : hits) {
+        char name[8];
+        size_t length = 0;
+        for (uint64_t word = packedNames[i]; word && length < 8; word >>= 8) {
+            name[length++] = static_cast<char>(word & 0xFF);
+        }
+        if (length > 0 && WadNames::matches(pattern, std::string_view(name, length))) {
+            matches->push_back(descriptors[i]);
+        }
+    }
+    return matches->size() - before;
+}
+
+int Wad::refresh(const std::function<void(Node*)> &dropping, std::vector<Node*> *added) {
+    // the other writer may have moved the end of the file, map it again afterwards
+    if (mappedWrites) {
+        unmapFile();
+        int changed = refresh(dropping, added);
+        mapFile();
+        return changed;
+    }
+    WadStatsTimer timer(WadStats::Refresh);
+    // a tool that writes a new copy and renames it over the archive leaves fd on the old inode
+    struct stat named, opened;
+    if (stat(filePath.c_str(), &named) == 0 && fstat(fd, &opened) == 0 && (named.st_ino != opened.st_ino || named.st_dev != opened.st_dev)) {
+        int reopened = open(filePath.c_str(), readOnly ? O_RDONLY : O_RDWR);
+        if (reopened < 0) {
+            return -1;
+        }
+        close(fd);
+        fd = reopened;
+    }
+    TableHeader header;
+    if (!readTableHeader(fd, header) || (header.compressed && !WadCodec::available())) {
+        return -1;
+    }
+    std::vector<char> table(header.count * (header.extended ? 24 : 16));
+    if (pread(fd, table.data(), table.size(), header.offset) != static_cast<ssize_t>(table.size())) {
+        return -1;
+    }
+
+    // whatever the other writer did to lump bytes, cached data and the free list may be stale now
+    freeExtents.clear();
+    vacated.clear();
+    checksums.clear();
+    contentIndex.clear();
+    contentIndexed = false;
+    blockIndexes.clear();
+    blockIndexBytes = 0;
+    blockCache.clear();
+    blockRecent.clear();
+    blockCacheUsed = 0;
+    namesIndexed = false;
+
+    // a different descriptor layout or compression changes what every entry means
+    uint64_t first = 0;
+    if (header.extended == extended && header.compressed == compressed) {
+        first = std::min<uint64_t>(descriptors.size(), header.count);
+    }
+    magic = header.magic;
+    extended = header.extended;
+    compressed = header.compressed;
+    directoryOffset = header.offset;
+
+    // the unchanged prefix of names keeps its nodes, only extents are updated in place
+    int changed = 0;
+    for (uint64_t i = 0; i < first; ++i) {
+        uint64_t offset = 0, length = 0;
+        std::string_view name;
+        decodeDescriptor(table.data() + i * descriptorSize(), offset, length, name);
+        Node* node = descriptors[i];
+        if (!node ? !name.empty() : node->filename != name) {
+            first = i;
+            break;
+        }
+        if (node && (node->offset != offset || node->length != length)) {
+            node->offset = offset;
+            node->length = length;
+            changed++;
+        }
+    }
+
+    // everything from the first renamed, inserted or removed descriptor on is parsed again
+    std::vector<Node*> dropped;
+    for (uint64_t i = first; i < descriptors.size(); ++i) {
+        Node* node = descriptors[i];
+        if (!node) {
+            tombstones--;
+            continue;
+        }
+        // descendants follow their ancestor in the table, so only the tops of dropped subtrees
+        // hang off kept nodes
+        if (node->parent == root || node->parent->index < first) {
+            dropping(node);
+            detach(node);
+        }
+        dropped.push_back(node);
+    }
+    for (Node* node : dropped) {
+        treeBytes -= nodeBytes(node);
+        delete node;
+    }
+    changed += descriptors.size() - first + header.count - first;
+    descriptors.resize(first);
+    parseTable(table, first, added);
+    numDescriptor = descriptors.size();
+    measureFile();
+    WadStats::add(WadStats::DescriptorsRefreshed, changed);
+    return changed;
+}
@@ -1,67 +1,278 @@
+#pragma once
+
 #include <iostream>
 #include <fstream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
+#include <string_view>
 #include <cstring>
 #include <vector>
 #include <sstream>
 #include <filesystem>
 #include <algorithm>
 #include <functional>
+#include <unordered_map>
+#include <list>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
 #include <cctype>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "WadStats.h"
+#include "WadTrace.h"
+#include "WadCodec.h"
+#include "WadNames.h"
+
+// classic IWAD/PWAD archives use 32-bit offsets and a 12 byte header with 16 byte descriptors
+// the extended variant lifts the 4 GiB limit:
+//   header:     "XWAD", u32 flags, u64 numDescriptor, u64 directoryOffset
+//   descriptor: u64 offset, u64 length, char name[8]
+// with WAD_FLAG_COMPRESSED set, lumps are stored block compressed, see WadCodec.h
+#define WAD_EXTENDED_MAGIC "XWAD"
+#define WAD_CLASSIC_HEADER_SIZE 12
+#define WAD_EXTENDED_HEADER_SIZE 24
+// removed entries leave an all zero descriptor in place, the loader skips them and the next
+// rewrite of that part of the table drops them
 
 struct Node {
     // filename, offset, length, way to store other files if given descriptor is directory
     std::string filename;
     std::string fullPath;
-    unsigned int offset;
-    unsigned int length;
+    uint64_t offset;
+    uint64_t length;
     bool isFile;
+    // position of this node's descriptor in the on-disk table, unused for the root
+    uint64_t index = 0;
     Node* parent;
     std::vector<Node*> children;
+    // a directory's lock guards its children, a lump's its extent, edits hold every directory above
+    // the node they change shared and that node exclusive, so edits in different namespaces overlap
+    std::shared_mutex lock;
 
-    Node(const std::string& x, bool w, unsigned int y = 0, unsigned int z = 0, Node* t = nullptr) : filename(x), isFile(w), offset(y), length(z), parent(t) {
-        std::string pathName = x;
-        if (!isFile) {
-            if (x.size() >= 6 && x.substr(x.size() - 6) == "_START") {
-                pathName = x.substr(0, x.size() - 6);
-            } else if (x.size() >= 4 && x.substr(x.size() - 4) == "_END") {
-                pathName = x.substr(0, x.size() - 4);
-            }
-        }
+    Node(const std::string& x, bool w, uint64_t y = 0, uint64_t z = 0, Node* t = nullptr) : filename(x), isFile(w), offset(y), length(z), parent(t) {
+        std::string_view pathName = isFile ? std::string_view(filename) : WadNames::pathName(filename);
         if (parent) {
-            fullPath = parent->fullPath + "/" + pathName;
-        } else {
-            fullPath = pathName;
+            fullPath = parent->parent ? parent->fullPath : "";
+            fullPath += "/";
         }
+        fullPath += pathName;
     }
 };
 
+// where a lump's bytes sit in the archive file, for readers that pread or mmap it themselves
+struct WadExtent {
+    std::string filePath;
+    uint64_t offset = 0;
+    // raw lump size and the bytes it takes in the file, they only differ in compressed archives
+    uint64_t length = 0;
+    uint64_t stored = 0;
+    bool compressed = false;
+};
+
 class Wad {
+    struct CachedBlock {
+        std::vector<char> data;
+        std::list<uint64_t>::iterator recent;
+    };
+    // locks taken from the root down to a node, released by the destructor
+    struct PathLock {
+        std::vector<std::shared_mutex*> shared;
+        std::shared_mutex* exclusive = nullptr;
+        ~PathLock();
+    };
+
     std::string filePath;
     std::string magic;
-    unsigned int numDescriptor;
-    unsigned int directoryOffset;
-    std::fstream fileStream;
+    uint64_t numDescriptor;
+    uint64_t directoryOffset;
+    bool extended;
+    bool compressed = false;
+    int fd;
+    // opened O_RDONLY because the file cannot be written, every edit fails with -1 (or null)
+    bool readOnly = false;
     Node* root;
+    // descriptors, the header, the free list's neighbours (checksums, content index), the mapping
+    // and every node's index: creates and writes run their tree and data work in parallel and
+    // take this one to commit
+    std::mutex tableLock;
+    // every node except the root, in descriptor table order, so descriptors[i]->index == i
+    // tombstoned slots are null until a table rewrite drops them
+    std::vector<Node*> descriptors;
+    uint64_t tombstones = 0;
+    // heap taken by the node tree, kept up to date as nodes come and go so getMemoryUsage is cheap
+    // enough to ask on every access
+    size_t treeBytes = 0;
+    // stored extents released by removes and truncates, offset -> size, neighbours merged
+    // kept for this session only, space freed before the archive was loaded comes back on convertTo
+    std::map<uint64_t, uint64_t> freeExtents;
+    // lump paths that left an offset this session, a write never goes back to where its own path
+    // was, so a lump rewritten in reused space never shows the extent a sidecar knows it under
+    std::unordered_multimap<uint64_t, std::string> vacated;
+    std::mutex extentLock;
+    // end of everything allocated in the file, appends bump it without a lock (see reserve)
+    // the table owns [directoryOffset, tableLimit) and grows in place only while that range
+    // still ends the file
+    std::atomic<uint64_t> fileEnd{0};
+    uint64_t tableLimit = 0;
+    // crc32c of stored bytes by extent offset -> (stored size, crc), dropped when the extent is released
+    std::unordered_map<uint64_t, std::pair<uint64_t, uint32_t>> checksums;
+    // every lump name packed into one word (WadNames::pack) in table order, 0 for markers and
+    // tombstones, rebuilt by the first search after the table changed
+    std::vector<uint64_t> packedNames;
+    bool namesIndexed = false;
+    // optional content index for deduplicating writes: hash of the bytes -> (offset, length)
+    bool deduplicate = false;
+    bool contentIndexed = false;
+    std::unordered_multimap<uint64_t, std::pair<uint64_t, uint64_t>> contentIndex;
+    // compressed archives only: block index per lump offset, read on first access, and an lru of
+    // decompressed blocks keyed by lump offset + block number, concurrent reads take cacheLock
+    std::unordered_map<uint64_t, std::vector<uint64_t>> blockIndexes;
+    size_t blockIndexBytes = 0;
+    std::unordered_map<uint64_t, CachedBlock> blockCache;
+    std::list<uint64_t> blockRecent;
+    size_t blockCacheUsed = 0;
+    size_t blockCacheLimit = 8 << 20;
+    std::mutex cacheLock;
+    // shared mapping of the file for setMappedWrites, the file is grown ahead of the data in large
+    // steps so mappedSize is the file size and fileEnd is where the archive really ends
+    // dirty holds page ranges written since the last flush, start -> end
+    bool mappedWrites = false;
+    char* mapping = nullptr;
+    uint64_t mappedSize = 0;
+    std::map<uint64_t, uint64_t> dirty;
 
     private:
         // constructor
         Wad(const std::string &x);
+        size_t descriptorSize();
+        void encodeExtent(char *descriptor, uint64_t offset, uint64_t length);
+        void encodeDescriptor(char *descriptor, uint64_t offset, uint64_t length, const std::string &name);
+        bool writeHeader();
+        bool writeDescriptor(Node* node);
+        bool markTombstone(Node* node);
+        bool markTombstones(const std::vector<Node*> &nodes);
+        void reviveTombstone(Node* node);
+        bool writeEntries(uint64_t offset, Node* const *entries, size_t count);
+        bool rewriteTable(uint64_t position, const std::vector<Node*> &inserted, uint64_t tableOffset);
+        uint64_t rewrittenCount(uint64_t position, size_t inserted);
+        bool tableRoom(size_t inserted);
+        bool moveTable(uint64_t position, const std::vector<Node*> &inserted, uint64_t &oldOffset, uint64_t &oldSize);
+        void measureFile();
+        void decodeDescriptor(const char *descriptor, uint64_t &offset, uint64_t &length, std::string_view &name);
+        void parseTable(const std::vector<char> &table, uint64_t first, std::vector<Node*> *added);
+        Node* lookup(std::string_view path);
+        Node* lockPath(std::string_view path, PathLock &held);
+        uint64_t insertPosition(Node* parent);
+        bool joinsMap(uint64_t position, std::string_view name);
+        bool insertDescriptors(uint64_t position, const std::vector<Node*> &nodes);
+        void buildContentIndex();
+        bool findDuplicate(uint64_t hash, const char *buffer, size_t length, uint64_t &offset);
+        ssize_t readExtent(uint64_t offset, uint64_t length, char *buffer, size_t size, uint64_t position);
+        const std::vector<char>* readBlock(uint64_t offset, uint64_t length, uint64_t block);
+        uint64_t storedLength(Node* node);
+        bool isShared(Node* node);
+        void releaseExtent(Node* node);
+        bool removeNode(Node* node);
+        void dropNode(Node* node);
+        void releaseRange(uint64_t offset, uint64_t size);
+        void vacate(Node* node);
+        bool allocateExtent(uint64_t size, const std::string &path, uint64_t &offset);
+        bool reserve(uint64_t size, uint64_t &offset);
+        ssize_t writeLump(Node* node, const char *buffer, size_t length);
+        bool mapFile();
+        void unmapFile();
+        void trimFile();
+        char* writable(uint64_t offset, size_t size);
+        bool writeAt(const void *data, size_t size, uint64_t offset);
 
     public:
         std::vector<std::string> split(const std::string &path);
         Node* dfs(Node* current, const std::vector<std::string>& pathParts, size_t index);
         static Wad* loadWad(const std::string &path);
+        ~Wad();
+        Node* getRoot();
+        // lookups and reads take a string_view and walk the path in place, without allocating
+        // the std::string and const char* overloads forward to them
+        Node* getNode(std::string_view path);
+        Node* getNode(const std::string &path) { return getNode(std::string_view(path)); }
+        Node* getNode(const char *path) { return getNode(std::string_view(path)); }
+        size_t getMemoryUsage();
         std::string getMagic();
-        bool isContent(const std::string &path);
-        bool isDirectory(const std::string &path);
-        int getSize(const std::string &path);
-        int getContents(const std::string &path, char *buffer, int length, int offset = 0);
-        int getDirectory(const std::string &path, std::vector<std::string> *directory);
+        std::string getFilePath();
+        bool isExtended();
+        bool isCompressed();
+        // the file could only be opened for reading, creates, writes and edits all fail
+        bool isReadOnly();
+        // bytes of decompressed blocks kept around, compressed archives only
+        void setBlockCacheSize(size_t bytes);
+        // compress needs the XWAD layout and a zlib build, path must be another file than this archive
+        bool convertTo(const std::string &path, const std::string &magic, bool compress = false);
+        // when on, writeToFile points a lump at identical bytes already in the archive instead of appending
+        void setDeduplication(bool enabled);
+        // when on, lump data, descriptors and the header are copied straight into a shared mapping
+        // instead of written with pwrite, so a burst of small writes makes no system calls until the
+        // file has to grow, turning it off (or deleting the wad) flushes and trims the file again
+        bool setMappedWrites(bool enabled);
+        // makes everything written so far durable: msync of the dirty ranges and the file trimmed to
+        // the archive when mapped, fdatasync otherwise, 0 on success and -1 otherwise
+        int flush();
+        bool isContent(std::string_view path);
+        bool isContent(const std::string &path) { return isContent(std::string_view(path)); }
+        bool isContent(const char *path) { return isContent(std::string_view(path)); }
+        bool isDirectory(std::string_view path);
+        bool isDirectory(const std::string &path) { return isDirectory(std::string_view(path)); }
+        bool isDirectory(const char *path) { return isDirectory(std::string_view(path)); }
+        off_t getSize(std::string_view path);
+        off_t getSize(const std::string &path) { return getSize(std::string_view(path)); }
+        off_t getSize(const char *path) { return getSize(std::string_view(path)); }
+        off_t getSize(Node* node);
+        ssize_t getContents(std::string_view path, char *buffer, size_t length, off_t offset = 0);
+        ssize_t getContents(const std::string &path, char *buffer, size_t length, off_t offset = 0) { return getContents(std::string_view(path), buffer, length, offset); }
+        ssize_t getContents(const char *path, char *buffer, size_t length, off_t offset = 0) { return getContents(std::string_view(path), buffer, length, offset); }
+        ssize_t getContents(Node* node, char *buffer, size_t length, off_t offset = 0);
+        int getDirectory(std::string_view path, std::vector<std::string> *directory);
+        int getDirectory(const std::string &path, std::vector<std::string> *directory) { return getDirectory(std::string_view(path), directory); }
+        int getDirectory(const char *path, std::vector<std::string> *directory) { return getDirectory(std::string_view(path), directory); }
         void rebuildDescriptorList();
-        void createDirectory(const std::string &path);
-        void createFile(const std::string &path);
-        int writeToFile(const std::string &path, const char *buffer, int length, int offset = 0);
+        // createDirectory, createFile and writeToFile may run on several threads at once, alongside
+        // the lookups, getSize and getContents: they lock the path from the root down, build nodes,
+        // compress and store lump bytes in parallel and only queue up on the table to commit
+        // everything else needs the archive to itself
+        // both return the new node, or the one already there under that name, null on failure
+        Node* createDirectory(const std::string &path);
+        Node* createFile(const std::string &path);
+        ssize_t writeToFile(const std::string &path, const char *buffer, size_t length, off_t offset = 0);
+        ssize_t writeToFile(Node* node, const char *buffer, size_t length, off_t offset = 0);
+        // lumps whose name matches pattern: an exact name, a prefix like TROO*, or any '*' / '?' glob
+        // the packed names are scanned for the literal part of the pattern, four words at a time
+        // with avx2 when the cpu has it, and only those candidates get the full glob match
+        // safe alongside creates and writes, the scan holds the table lock
+        int findLumps(std::string_view pattern, std::vector<Node*> *matches);
+        // like the lookups these two may run alongside creates and writes, the node is held shared
+        bool getExtent(Node* node, WadExtent *extent);
+        // crc32c of the stored bytes, the same value wadverify keeps in its sidecar, the cache of
+        // them is shared and kept under the table lock
+        bool getChecksum(Node* node, uint32_t &crc);
+        // metadata edits touch a fixed number of descriptors and never shift the table:
+        // removes tombstone the entry, a rename within a directory rewrites the name in place
+        // all return 0 on success and -1 otherwise, map lumps are positional and cannot be edited
+        int removeFile(const std::string &path);
+        // only empty directories
+        int removeDirectory(const std::string &path);
+        // an existing file at the destination is replaced, moves to another directory re-insert
+        // the moved descriptors like createFile does
+        int renamePath(const std::string &from, const std::string &to);
+        // shrinks a lump, growing one is a write
+        int truncateFile(const std::string &path, uint64_t length);
+        // re-reads the header and descriptor table after another program changed the file and applies
+        // the difference: entries whose name is unchanged keep their node and only take the new extent,
+        // everything from the first renamed, inserted or removed entry on is dropped and parsed again
+        // dropping sees the top of each dropped subtree before it is freed, added receives the new ones
+        // cached lump data and the free list are discarded, returns the number of descriptors that
+        // changed or -1 if the table could not be read, in which case the tree is left as it was
+        int refresh(const std::function<void(Node*)> &dropping, std::vector<Node*> *added);
 };
\ No newline at end of file
@@ -0,0 +1,306 @@
+#include "WadBuilder.h"
+#include <climits>
+
+static const size_t pendingLimit = 1 << 20;
+
+// names are checked with the classifier the loader uses, a lump named like a marker would
+// open or close a namespace or map when the archive is read back
+static bool isLumpName(const std::string &name) {
+    return !name.empty() && name.size() <= 8 && WadNames::classify(name) == WadNameKind::Lump;
+}
+
+// order the engine expects map lumps in, used when packing a map directory
+// anything else sorts last, where the loader reads it back outside the map
+static int mapLumpRank(const std::string &name) {
+    int rank = WadNames::mapLumpRank(name);
+    return rank < 0 ? INT_MAX : rank;
+}
+
+WadBuilder::WadBuilder(int fd, const std::string &magic, bool compress) : fd(fd), magic(magic), extended(magic == WAD_EXTENDED_MAGIC), compress(compress), count(0) {
+    dataEnd = extended ? WAD_EXTENDED_HEADER_SIZE : WAD_CLASSIC_HEADER_SIZE;
+    pendingOffset = dataEnd;
+    pending.reserve(pendingLimit);
+}
+
+WadBuilder* WadBuilder::create(const std::string &path, const std::string &magic, bool compress) {
+    if (magic != "IWAD" && magic != "PWAD" && magic != WAD_EXTENDED_MAGIC) {
+        return nullptr;
+    }
+    if (compress && (magic != WAD_EXTENDED_MAGIC || !WadCodec::available())) {
+        return nullptr;
+    }
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return nullptr;
+    }
+    return new WadBuilder(fd, magic, compress);
+}
+
+WadBuilder::~WadBuilder() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void WadBuilder::addDescriptor(uint64_t offset, uint64_t length, const std::string &name) {
+    char descriptor[24] = {0};
+    size_t size = extended ? 24 : 16;
+    if (extended) {
+        std::memcpy(descriptor, &offset, 8);
+        std::memcpy(descriptor + 8, &length, 8);
+    } else {
+        uint32_t classicOffset = static_cast<uint32_t>(offset);
+        uint32_t classicLength = static_cast<uint32_t>(length);
+        std::memcpy(descriptor, &classicOffset, 4);
+        std::memcpy(descriptor + 4, &classicLength, 4);
+    }
+    std::memcpy(descriptor + size - 8, name.c_str(), std::min<size_t>(name.size(), 8));
+    directory.insert(directory.end(), descriptor, descriptor + size);
+    count++;
+    // a map runs on for as long as map lump names follow its marker in map order
+    WadNameKind kind = WadNames::classify(name);
+    if (kind == WadNameKind::MapMarker) {
+        afterMap = true;
+        mapRank = -1;
+    } else if (afterMap) {
+        mapRank = kind == WadNameKind::Lump ? WadNames::nextMapRank(mapRank, name) : -1;
+        afterMap = mapRank >= 0;
+    }
+}
+
+bool WadBuilder::reserve(uint64_t length) {
+    // classic archives cannot address past 4 GiB, the directory has to fit too
+    return extended || dataEnd + length + (count + 1) * 16 <= UINT32_MAX;
+}
+
+bool WadBuilder::flush() {
+    size_t written = 0;
+    while (written < pending.size()) {
+        ssize_t n = pwrite(fd, pending.data() + written, pending.size() - written, pendingOffset + written);
+        if (n <= 0) {
+            return false;
+        }
+        written += n;
+    }
+    pendingOffset += pending.size();
+    pending.clear();
+    return true;
+}
+
+bool WadBuilder::beginNamespace(const std::string &name) {
+    if (name.empty() || name.size() > 2 || !isLumpName(name)) {
+        return false;
+    }
+    addDescriptor(0, 0, name + "_START");
+    openNamespaces.push_back(name);
+    return true;
+}
+
+bool WadBuilder::endNamespace() {
+    if (openNamespaces.empty()) {
+        return false;
+    }
+    addDescriptor(0, 0, openNamespaces.back() + "_END");
+    openNamespaces.pop_back();
+    return true;
+}
+
+bool WadBuilder::addMarker(const std::string &name) {
+    if (WadNames::classify(name) != WadNameKind::MapMarker) {
+        return false;
+    }
+    addDescriptor(0, 0, name);
+    return true;
+}
+
+bool WadBuilder::addLump(const std::string &name, const char *buffer, size_t length) {
+    if (!isLumpName(name) || !reserve(length)) {
+        return false;
+    }
+    if (length == 0) {
+        addDescriptor(0, 0, name);
+        return true;
+    }
+    // compressed lumps store the encoded blob but keep the raw length in the descriptor
+    uint64_t rawLength = length;
+    std::vector<char> blob;
+    if (compress) {
+        if (!WadCodec::encode(buffer, length, &blob)) {
+            return false;
+        }
+        buffer = blob.data();
+        length = blob.size();
+    }
+    if (pending.size() + length > pendingLimit && !flush()) {
+        return false;
+    }
+    if (length >= pendingLimit) {
+        // big lumps skip the batch buffer
+        pending.assign(buffer, buffer + length);
+        if (!flush()) {
+            return false;
+        }
+    } else {
+        pending.insert(pending.end(), buffer, buffer + length);
+    }
+    addDescriptor(dataEnd, rawLength, name);
+    dataEnd += length;
+    return true;
+}
+
+bool WadBuilder::addLumpFromFile(const std::string &name, const std::string &hostPath) {
+    int in = open(hostPath.c_str(), O_RDONLY);
+    if (in < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(in, &st) != 0 || !isLumpName(name) || !reserve(st.st_size)) {
+        close(in);
+        return false;
+    }
+    uint64_t length = st.st_size;
+    bool ok = true;
+    // compressed lumps are encoded in memory, so they always take the addLump path
+    if (length < pendingLimit || compress) {
+        std::vector<char> data(length);
+        ok = pread(in, data.data(), length, 0) == static_cast<ssize_t>(length);
+        close(in);
+        return ok && addLump(name, data.data(), length);
+    }
+    // large files are copied by the kernel straight into place
+    ok = flush();
+    uint64_t copied = 0;
+    while (ok && copied < length) {
+        loff_t inOffset = copied;
+        loff_t outOffset = dataEnd + copied;
+        ssize_t n = copy_file_range(in, &inOffset, fd, &outOffset, length - copied, 0);
+        if (n <= 0) {
+            break;
+        }
+        copied += n;
+    }
+    // copy_file_range is not available everywhere, finish through user space
+    std::vector<char> chunk(copied < length ? pendingLimit : 0);
+    while (ok && copied < length) {
+        ssize_t n = pread(in, chunk.data(), std::min<uint64_t>(chunk.size(), length - copied), copied);
+        ok = n > 0 && pwrite(fd, chunk.data(), n, dataEnd + copied) == n;
+        copied += n > 0 ? n : 0;
+    }
+    close(in);
+    if (!ok) {
+        return false;
+    }
+    addDescriptor(dataEnd, length, name);
+    dataEnd += length;
+    pendingOffset = dataEnd;
+    return true;
+}
+
+bool WadBuilder::finish() {
+    while (!openNamespaces.empty()) {
+        endNamespace();
+    }
+    if (!flush()) {
+        return false;
+    }
+    char header[WAD_EXTENDED_HEADER_SIZE] = {0};
+    size_t headerSize = extended ? WAD_EXTENDED_HEADER_SIZE : WAD_CLASSIC_HEADER_SIZE;
+    std::memcpy(header, magic.c_str(), 4);
+    if (extended) {
+        uint32_t flags = compress ? WAD_FLAG_COMPRESSED : 0;
+        std::memcpy(header + 4, &flags, 4);
+        std::memcpy(header + 8, &count, 8);
+        std::memcpy(header + 16, &dataEnd, 8);
+    } else {
+        uint32_t classicCount = static_cast<uint32_t>(count);
+        uint32_t classicOffset = static_cast<uint32_t>(dataEnd);
+        std::memcpy(header + 4, &classicCount, 4);
+        std::memcpy(header + 8, &classicOffset, 4);
+    }
+    bool ok = pwrite(fd, directory.data(), directory.size(), dataEnd) == static_cast<ssize_t>(directory.size());
+    ok = ok && pwrite(fd, header, headerSize, 0) == static_cast<ssize_t>(headerSize);
+    ok = close(fd) == 0 && ok;
+    fd = -1;
+    return ok;
+}
+
+bool WadBuilder::joinsMap(const std::string &name) {
+    return afterMap && WadNames::nextMapRank(mapRank, name) >= 0;
+}
+
+uint64_t WadBuilder::getDataSize() {
+    return dataEnd;
+}
+
+uint64_t WadBuilder::getDescriptorCount() {
+    return count;
+}
+
+// same rules createFile applies, so the archive reads back with every lump where it was packed
+static bool packable(const std::string &name, bool inMap, bool joinsMap) {
+    return isLumpName(name) && inMap == joinsMap;
+}
+
+// a host file the build cannot open is left out like a name it cannot pack
+static bool readable(const std::string &path) {
+    int in = open(path.c_str(), O_RDONLY);
+    if (in < 0) {
+        return false;
+    }
+    close(in);
+    return true;
+}
+
+bool WadBuilder::buildFromDirectory(const std::string &hostDir, const std::string &wadPath, const std::string &magic, std::vector<std::string> *skipped, bool compress) {
+    WadBuilder* builder = create(wadPath, magic, compress);
+    if (!builder) {
+        return false;
+    }
+    bool ok = true;
+    // host directories named E#M# or MAP## become maps, other directories become namespaces, files
+    // become lumps, named the way the loader reads them back: marker names, map lumps outside a map
+    // or right behind one, and anything else inside a map are skipped rather than packed
+    std::function<void(const std::filesystem::path&, bool)> pack = [&](const std::filesystem::path &dir, bool inMap) {
+        std::vector<std::filesystem::directory_entry> entries;
+        std::error_code error;
+        for (const auto& entry : std::filesystem::directory_iterator(dir, error)) {
+            entries.push_back(entry);
+        }
+        if (error) {
+            ok = false;
+            return;
+        }
+        std::sort(entries.begin(), entries.end(), [&](const std::filesystem::directory_entry &a, const std::filesystem::directory_entry &b) {
+            std::string nameA = a.path().filename().string();
+            std::string nameB = b.path().filename().string();
+            if (inMap && mapLumpRank(nameA) != mapLumpRank(nameB)) {
+                return mapLumpRank(nameA) < mapLumpRank(nameB);
+            }
+            return nameA < nameB;
+        });
+        for (const auto& entry : entries) {
+            if (!ok) {
+                return;
+            }
+            std::string name = entry.path().filename().string();
+            if (entry.is_directory(error) && !inMap && WadNames::classify(name) == WadNameKind::MapMarker) {
+                builder->addMarker(name);
+                pack(entry.path(), true);
+            } else if (entry.is_directory(error) && !inMap && builder->beginNamespace(name)) {
+                pack(entry.path(), false);
+                builder->endNamespace();
+            } else if (entry.is_regular_file(error) && packable(name, inMap, builder->joinsMap(name)) && readable(entry.path().string())) {
+                ok = builder->addLumpFromFile(name, entry.path().string());
+            } else if (skipped) {
+                skipped->push_back(entry.path().string());
+            }
+        }
+    };
+    pack(hostDir, false);
+    ok = builder->finish() && ok;
+    delete builder;
+    if (!ok) {
+        unlink(wadPath.c_str());
+    }
+    return ok;
+}
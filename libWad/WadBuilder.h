@@ -0,0 +1,47 @@
+#pragma once
+
+#include "Wad.h"
+#include <sys/stat.h>
+
+// writes a new archive in one sequential pass: lump data is streamed out as entries are added,
+// the descriptor list and header are written once by finish()
+class WadBuilder {
+    int fd;
+    std::string magic;
+    bool extended;
+    bool compress;
+    uint64_t dataEnd;
+    uint64_t count;
+    std::vector<char> directory;
+    // namespaces still waiting for their _END
+    std::vector<std::string> openNamespaces;
+    // the last descriptor is a map marker or one of its lumps, and the rank of that lump, see joinsMap
+    bool afterMap = false;
+    int mapRank = -1;
+    // small lumps are batched here so a tree of tiny files is not one write per file
+    std::vector<char> pending;
+    uint64_t pendingOffset;
+
+    private:
+        // constructor
+        WadBuilder(int fd, const std::string &magic, bool compress);
+        void addDescriptor(uint64_t offset, uint64_t length, const std::string &name);
+        bool reserve(uint64_t length);
+        bool flush();
+
+    public:
+        // compress stores lumps block compressed, only with the XWAD layout and a zlib build
+        static WadBuilder* create(const std::string &path, const std::string &magic = "PWAD", bool compress = false);
+        ~WadBuilder();
+        bool beginNamespace(const std::string &name);
+        bool endNamespace();
+        bool addMarker(const std::string &name);
+        bool addLump(const std::string &name, const char *buffer, size_t length);
+        bool addLumpFromFile(const std::string &name, const std::string &hostPath);
+        bool finish();
+        // a lump called name added now would be read back as part of the map before it
+        bool joinsMap(const std::string &name);
+        uint64_t getDataSize();
+        uint64_t getDescriptorCount();
+        static bool buildFromDirectory(const std::string &hostDir, const std::string &wadPath, const std::string &magic = "PWAD", std::vector<std::string> *skipped = nullptr, bool compress = false);
+};
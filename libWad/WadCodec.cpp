@@ -0,0 +1,58 @@
+#include "WadCodec.h"
+#include <algorithm>
+#include <cstring>
+#ifdef WAD_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+bool WadCodec::available() {
+#ifdef WAD_HAVE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint64_t WadCodec::blockCount(uint64_t length) {
+    return (length + WAD_BLOCK_SIZE - 1) / WAD_BLOCK_SIZE;
+}
+
+uint64_t WadCodec::indexSize(uint64_t length) {
+    return blockCount(length) * sizeof(uint64_t);
+}
+
+bool WadCodec::encode(const char *data, uint64_t length, std::vector<char> *blob) {
+#ifdef WAD_HAVE_ZLIB
+    uint64_t blocks = blockCount(length);
+    blob->assign(indexSize(length), 0);
+    std::vector<Bytef> packed(compressBound(WAD_BLOCK_SIZE));
+    for (uint64_t i = 0; i < blocks; ++i) {
+        const char *raw = data + i * WAD_BLOCK_SIZE;
+        size_t rawSize = std::min<uint64_t>(WAD_BLOCK_SIZE, length - i * WAD_BLOCK_SIZE);
+        uLongf packedSize = packed.size();
+        if (compress2(packed.data(), &packedSize, reinterpret_cast<const Bytef*>(raw), rawSize, Z_DEFAULT_COMPRESSION) == Z_OK && packedSize < rawSize) {
+            blob->insert(blob->end(), packed.data(), packed.data() + packedSize);
+        } else {
+            blob->insert(blob->end(), raw, raw + rawSize);
+        }
+        uint64_t end = blob->size() - indexSize(length);
+        std::memcpy(blob->data() + i * sizeof(uint64_t), &end, sizeof(uint64_t));
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool WadCodec::decodeBlock(const char *stored, size_t storedSize, char *out, size_t rawSize) {
+    if (storedSize == rawSize) {
+        std::memcpy(out, stored, rawSize);
+        return true;
+    }
+#ifdef WAD_HAVE_ZLIB
+    uLongf outSize = rawSize;
+    return uncompress(reinterpret_cast<Bytef*>(out), &outSize, reinterpret_cast<const Bytef*>(stored), storedSize) == Z_OK && outSize == rawSize;
+#else
+    return false;
+#endif
+}
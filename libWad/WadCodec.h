@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// block compression for compressed XWAD archives, flagged in the header's reserved word
+// a compressed lump is stored as u64 blockEnd[blockCount] followed by the blocks back to back,
+// block i holds raw bytes [i * WAD_BLOCK_SIZE, (i + 1) * WAD_BLOCK_SIZE) and ends blockEnd[i]
+// bytes after the index, blocks that do not shrink are stored as they are
+// descriptors keep the uncompressed length, so the block count never has to be stored
+#define WAD_FLAG_COMPRESSED 0x1
+#define WAD_BLOCK_SIZE (64 * 1024)
+
+class WadCodec {
+    public:
+        // false when libWad was built without zlib, compressed archives cannot be opened then
+        static bool available();
+        static uint64_t blockCount(uint64_t length);
+        static uint64_t indexSize(uint64_t length);
+        static bool encode(const char *data, uint64_t length, std::vector<char> *blob);
+        static bool decodeBlock(const char *stored, size_t storedSize, char *out, size_t rawSize);
+};
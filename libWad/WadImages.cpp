@@ -0,0 +1,259 @@
+#include "WadImages.h"
+#include <algorithm>
+#include <cstring>
+
+static const std::string_view viewSuffix = ".bmp";
+static const size_t flatWidth = 64;
+// larger than any vanilla or limit removing port draws
+static const uint32_t maxDimension = 4096;
+
+WadImages::WadImages(size_t limit) : limit(limit) {}
+
+// top level namespace of a lump, nested ones (F/F1) take after it
+static std::string_view topNamespace(std::string_view lumpPath) {
+    size_t end = lumpPath.find('/', 1);
+    return end == std::string_view::npos ? std::string_view() : lumpPath.substr(1, end - 1);
+}
+
+bool WadImages::isGraphic(std::string_view lumpPath) {
+    std::string_view space = topNamespace(lumpPath);
+    for (std::string_view graphic : {"S", "SS", "P", "PP", "P1", "P2", "P3", "F", "FF", "F1", "F2", "F3"}) {
+        if (space == graphic) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool WadImages::isFlat(std::string_view lumpPath) {
+    return isGraphic(lumpPath) && topNamespace(lumpPath)[0] == 'F';
+}
+
+std::string_view WadImages::sourceOf(std::string_view path) {
+    if (path.size() <= viewSuffix.size() || path.substr(path.size() - viewSuffix.size()) != viewSuffix) {
+        return std::string_view();
+    }
+    std::string_view source = path.substr(0, path.size() - viewSuffix.size());
+    return isGraphic(source) && source.back() != '/' ? source : std::string_view();
+}
+
+static uint16_t readU16(const char *data) {
+    uint16_t value;
+    std::memcpy(&value, data, 2);
+    return value;
+}
+
+static uint32_t readU32(const char *data) {
+    uint32_t value;
+    std::memcpy(&value, data, 4);
+    return value;
+}
+
+static void writeU16(std::vector<char> &out, size_t at, uint16_t value) {
+    std::memcpy(out.data() + at, &value, 2);
+}
+
+static void writeU32(std::vector<char> &out, size_t at, uint32_t value) {
+    std::memcpy(out.data() + at, &value, 4);
+}
+
+// width and height of a picture or flat, false if the lump cannot be one
+static bool dimensions(std::string_view lumpPath, const char *header, size_t headerSize, uint64_t length, uint32_t &width, uint32_t &height) {
+    if (WadImages::isFlat(lumpPath)) {
+        width = flatWidth;
+        height = length / flatWidth;
+        return length > 0 && length % flatWidth == 0 && height <= maxDimension;
+    }
+    if (headerSize < 4 || length < 8) {
+        return false;
+    }
+    width = readU16(header);
+    height = readU16(header + 2);
+    return width > 0 && height > 0 && width <= maxDimension && height <= maxDimension && length >= 8 + 4 * uint64_t(width);
+}
+
+int64_t WadImages::viewSize(std::string_view lumpPath, const char *header, size_t headerSize, uint64_t length) {
+    uint32_t width, height;
+    if (!dimensions(lumpPath, header, headerSize, length, width, height)) {
+        return -1;
+    }
+    return HeaderSize + uint64_t(width) * height * 4;
+}
+
+bool WadImages::convert(std::string_view lumpPath, const std::vector<char> &lump, const char *palette, std::vector<char> *bmp) {
+    uint32_t width, height;
+    if (!dimensions(lumpPath, lump.data(), lump.size(), lump.size(), width, height)) {
+        return false;
+    }
+    // palette index per pixel, -1 where a picture leaves a hole
+    std::vector<int16_t> pixels(size_t(width) * height, -1);
+    if (isFlat(lumpPath)) {
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            pixels[i] = static_cast<uint8_t>(lump[i]);
+        }
+    } else {
+        for (uint32_t x = 0; x < width; ++x) {
+            uint64_t at = readU32(lump.data() + 8 + 4 * x);
+            // tall patches count a top that does not increase as relative to the previous post
+            int top = -1;
+            while (at < lump.size() && static_cast<uint8_t>(lump[at]) != 0xFF) {
+                if (at + 2 > lump.size()) {
+                    return false;
+                }
+                int delta = static_cast<uint8_t>(lump[at]);
+                int count = static_cast<uint8_t>(lump[at + 1]);
+                top = delta <= top ? top + delta : delta;
+                if (at + 3 + count > lump.size()) {
+                    return false;
+                }
+                for (int y = 0; y < count && top + y < int(height); ++y) {
+                    pixels[size_t(top + y) * width + x] = static_cast<uint8_t>(lump[at + 3 + y]);
+                }
+                at += 4 + count;
+            }
+        }
+    }
+
+    uint64_t imageSize = uint64_t(width) * height * 4;
+    bmp->assign(HeaderSize + imageSize, 0);
+    // BITMAPFILEHEADER
+    (*bmp)[0] = 'B';
+    (*bmp)[1] = 'M';
+    writeU32(*bmp, 2, HeaderSize + imageSize);
+    writeU32(*bmp, 10, HeaderSize);
+    // BITMAPV4HEADER, positive height stores the rows bottom up
+    writeU32(*bmp, 14, 108);
+    writeU32(*bmp, 18, width);
+    writeU32(*bmp, 22, height);
+    writeU16(*bmp, 26, 1);
+    writeU16(*bmp, 28, 32);
+    writeU32(*bmp, 30, 3);
+    writeU32(*bmp, 34, imageSize);
+    writeU32(*bmp, 38, 2835);
+    writeU32(*bmp, 42, 2835);
+    writeU32(*bmp, 54, 0x00FF0000);
+    writeU32(*bmp, 58, 0x0000FF00);
+    writeU32(*bmp, 62, 0x000000FF);
+    writeU32(*bmp, 66, 0xFF000000);
+    writeU32(*bmp, 70, 0x73524742);
+    char* out = bmp->data() + HeaderSize;
+    for (uint32_t y = 0; y < height; ++y) {
+        const int16_t* row = pixels.data() + size_t(height - 1 - y) * width;
+        for (uint32_t x = 0; x < width; ++x, out += 4) {
+            if (row[x] < 0) {
+                continue;
+            }
+            const uint8_t grey[3] = {uint8_t(row[x]), uint8_t(row[x]), uint8_t(row[x])};
+            const uint8_t* rgb = palette ? reinterpret_cast<const uint8_t*>(palette) + 3 * row[x] : grey;
+            out[0] = rgb[2];
+            out[1] = rgb[1];
+            out[2] = rgb[0];
+            out[3] = char(0xFF);
+        }
+    }
+    return true;
+}
+
+// copies what a view has at offset, 0 past its end
+static ssize_t copyView(const std::vector<char> &bmp, char *buffer, size_t length, off_t offset) {
+    if (offset < 0) {
+        return -1;
+    }
+    if (static_cast<uint64_t>(offset) >= bmp.size()) {
+        return 0;
+    }
+    size_t n = std::min<uint64_t>(length, bmp.size() - offset);
+    std::memcpy(buffer, bmp.data() + offset, n);
+    return n;
+}
+
+int64_t WadImages::getSize(const void *owner, const std::string &lumpPath) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto owned = owners.find(owner);
+    if (owned == owners.end()) {
+        return -1;
+    }
+    auto view = owned->second.views.find(lumpPath);
+    return view == owned->second.views.end() ? -1 : static_cast<int64_t>(view->second.bmp.size());
+}
+
+ssize_t WadImages::read(const void *owner, const std::string &lumpPath, char *buffer, size_t length, off_t offset) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto owned = owners.find(owner);
+    if (owned == owners.end()) {
+        return -1;
+    }
+    auto view = owned->second.views.find(lumpPath);
+    if (view == owned->second.views.end()) {
+        return -1;
+    }
+    recent.splice(recent.begin(), recent, view->second.recent);
+    return copyView(view->second.bmp, buffer, length, offset);
+}
+
+// only called with lock held
+void WadImages::drop(std::unordered_map<const void*, Owned>::iterator owned, std::unordered_map<std::string, Cached>::iterator view) {
+    used -= view->second.bmp.size();
+    owned->second.used -= view->second.bmp.size();
+    recent.erase(view->second.recent);
+    owned->second.views.erase(view);
+    if (owned->second.views.empty()) {
+        owners.erase(owned);
+    }
+}
+
+ssize_t WadImages::store(const void *owner, const std::string &lumpPath, std::vector<char> &&bmp, char *buffer, size_t length, off_t offset) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto owned = owners.find(owner);
+    if (owned != owners.end()) {
+        auto view = owned->second.views.find(lumpPath);
+        if (view != owned->second.views.end()) {
+            drop(owned, view);
+        }
+    }
+    recent.emplace_front(owner, lumpPath);
+    Owned& target = owners[owner];
+    Cached& cached = target.views[lumpPath];
+    cached.bmp = std::move(bmp);
+    cached.recent = recent.begin();
+    used += cached.bmp.size();
+    target.used += cached.bmp.size();
+    // the view being handed out stays, even if it alone is over budget
+    ssize_t copied = copyView(cached.bmp, buffer, length, offset);
+    while (used > limit && recent.back() != recent.front()) {
+        auto victim = owners.find(recent.back().first);
+        drop(victim, victim->second.views.find(recent.back().second));
+    }
+    return copied;
+}
+
+void WadImages::invalidate(const void *owner, const std::string &lumpPath) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto owned = owners.find(owner);
+    if (owned == owners.end()) {
+        return;
+    }
+    auto view = owned->second.views.find(lumpPath);
+    if (view != owned->second.views.end()) {
+        drop(owned, view);
+    }
+}
+
+void WadImages::clear(const void *owner) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto owned = owners.find(owner);
+    if (owned == owners.end()) {
+        return;
+    }
+    for (auto& view : owned->second.views) {
+        recent.erase(view.second.recent);
+    }
+    used -= owned->second.used;
+    owners.erase(owned);
+}
+
+size_t WadImages::getMemoryUsage(const void *owner) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto owned = owners.find(owner);
+    return owned == owners.end() ? 0 : owned->second.used + owned->second.views.size() * (sizeof(Cached) + 64);
+}
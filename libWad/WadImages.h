@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+
+// BMP views of Doom graphics, converted on first read and kept in an lru under a byte budget
+//   pictures   sprites (S_, SS_) and patches (P_, PP_, P1_ ...): u16 width, u16 height, s16 left,
+//              s16 top, u32 columnOffset[width], each column a run of posts
+//              (u8 top, u8 count, u8 pad, count pixels, u8 pad) closed by top 0xFF
+//   flats      (F_, FF_, F1_ ...): raw 64 pixel wide rows
+// pixels go through the first PLAYPAL palette into a 32-bit BGRA bitmap, holes in a picture are
+// transparent, the size of a view follows from width and height alone, so it is known from the
+// picture header without decoding anything
+// one cache may serve several overlays (a library shares one across its archives), each keeps its
+// views under its own owner key and the byte budget is shared, every cache call takes its own lock
+class WadImages {
+    struct Cached {
+        std::vector<char> bmp;
+        std::list<std::pair<const void*, std::string>>::iterator recent;
+    };
+    struct Owned {
+        // source lump path -> converted bitmap
+        std::unordered_map<std::string, Cached> views;
+        size_t used = 0;
+    };
+
+    size_t limit;
+    size_t used = 0;
+    std::unordered_map<const void*, Owned> owners;
+    // (owner, lump path) of every view, most recently used first
+    std::list<std::pair<const void*, std::string>> recent;
+    std::mutex lock;
+
+    private:
+        void drop(std::unordered_map<const void*, Owned>::iterator owned, std::unordered_map<std::string, Cached>::iterator view);
+
+    public:
+        // header of the bitmaps written here: BITMAPFILEHEADER and a BITMAPV4HEADER with an alpha mask
+        static const size_t HeaderSize = 14 + 108;
+
+        WadImages(size_t limit);
+        // the lump a view path stands for, empty when path is not NAME.bmp inside a graphics namespace
+        static std::string_view sourceOf(std::string_view path);
+        static bool isGraphic(std::string_view lumpPath);
+        static bool isFlat(std::string_view lumpPath);
+        // bitmap size from the first 4 bytes of a picture, or from the length of a flat
+        // -1 when the lump cannot be one
+        static int64_t viewSize(std::string_view lumpPath, const char *header, size_t headerSize, uint64_t length);
+        // palette is 768 bytes of rgb, or null for a grey ramp, false for a damaged picture
+        static bool convert(std::string_view lumpPath, const std::vector<char> &lump, const char *palette, std::vector<char> *bmp);
+
+        // views are copied out under the lock, another owner may evict them right after
+        // size and read are -1 when the view of lumpPath is not cached
+        int64_t getSize(const void *owner, const std::string &lumpPath);
+        ssize_t read(const void *owner, const std::string &lumpPath, char *buffer, size_t length, off_t offset);
+        // caches bmp and reads from it like read
+        ssize_t store(const void *owner, const std::string &lumpPath, std::vector<char> &&bmp, char *buffer, size_t length, off_t offset);
+        void invalidate(const void *owner, const std::string &lumpPath);
+        void clear(const void *owner);
+        // what owner's views take
+        size_t getMemoryUsage(const void *owner);
+};
@@ -0,0 +1,161 @@
+#include "WadLibrary.h"
+
+WadLibrary::WadLibrary(const std::string &dir, size_t memoryLimit, size_t openLimit) : directory(dir), memoryLimit(memoryLimit), openLimit(openLimit), memoryUsed(0) {}
+
+WadLibrary* WadLibrary::loadLibrary(const std::string &dir, size_t memoryLimit, size_t openLimit) {
+    std::error_code error;
+    if (!std::filesystem::is_directory(dir, error)) {
+        return nullptr;
+    }
+    // nothing is read up front, cold archives cost nothing until first touched
+    return new WadLibrary(dir, memoryLimit, std::max<size_t>(openLimit, 1));
+}
+
+WadLibrary::~WadLibrary() {}
+
+bool WadLibrary::isWadName(const std::string &name) {
+    if (name.size() <= 4 || name.find('/') != std::string::npos) {
+        return false;
+    }
+    std::string extension = name.substr(name.size() - 4);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension == ".wad";
+}
+
+std::shared_ptr<WadOverlay> WadLibrary::acquire(const std::string &name) {
+    std::unique_lock<std::mutex> lock(libraryLock);
+    loadDone.wait(lock, [&] { return loading.count(name) == 0; });
+    auto it = loaded.find(name);
+    if (it != loaded.end()) {
+        recent.splice(recent.begin(), recent, it->second.recent);
+        account(it->second);
+        evict(name);
+        return it->second.wad;
+    }
+    if (!isWadName(name)) {
+        return nullptr;
+    }
+    // parsing a cold archive is the slow part, lookups of resident ones go on meanwhile
+    loading.insert(name);
+    lock.unlock();
+    std::shared_ptr<WadOverlay> wad(WadOverlay::loadOverlay({directory + "/" + name}));
+    lock.lock();
+    loading.erase(name);
+    loadDone.notify_all();
+    if (!wad) {
+        return nullptr;
+    }
+    // settings are read under the lock, a setter that ran during the load is not missed
+    wad->setDeduplication(deduplicate);
+    wad->setImageViews(images);
+    wad->setMappedWrites(mappedWrites);
+    recent.push_front(name);
+    account(loaded.emplace(name, Archive{wad, 0, recent.begin()}).first->second);
+    evict(name);
+    return wad;
+}
+
+void WadLibrary::setDeduplication(bool enabled) {
+    std::lock_guard<std::mutex> lock(libraryLock);
+    deduplicate = enabled;
+    for (auto& archive : loaded) {
+        archive.second.wad->setDeduplication(enabled);
+    }
+}
+
+void WadLibrary::setImageViews(size_t cacheBytes) {
+    std::lock_guard<std::mutex> lock(libraryLock);
+    images = cacheBytes ? std::make_shared<WadImages>(cacheBytes) : nullptr;
+    for (auto& archive : loaded) {
+        archive.second.wad->setImageViews(images);
+    }
+}
+
+void WadLibrary::setMappedWrites(bool enabled) {
+    std::lock_guard<std::mutex> lock(libraryLock);
+    mappedWrites = enabled;
+    for (auto& archive : loaded) {
+        archive.second.wad->setMappedWrites(enabled);
+    }
+}
+
+int WadLibrary::flush() {
+    std::lock_guard<std::mutex> lock(libraryLock);
+    int result = 0;
+    for (auto& archive : loaded) {
+        if (archive.second.wad->flush() < 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+// getMemoryUsage is a handful of counters, cheap enough for every access
+void WadLibrary::account(Archive &archive) {
+    memoryUsed -= archive.memory;
+    archive.memory = archive.wad->getMemoryUsage();
+    memoryUsed += archive.memory;
+}
+
+void WadLibrary::evict(const std::string &keep) {
+    // the archive being handed out is never the victim, even if it alone is over budget, and one
+    // a caller still holds stays too, so a file is never open in two overlays at once
+    auto candidate = recent.end();
+    while ((memoryUsed > memoryLimit || loaded.size() > openLimit) && candidate != recent.begin()) {
+        --candidate;
+        auto victim = loaded.find(*candidate);
+        if (*candidate == keep || victim->second.wad.use_count() > 1) {
+            continue;
+        }
+        memoryUsed -= victim->second.memory;
+        loaded.erase(victim);
+        candidate = recent.erase(candidate);
+    }
+}
+
+int WadLibrary::refresh(const std::string &name) {
+    // a load still in progress may have read the file before it changed
+    std::unique_lock<std::mutex> lock(libraryLock);
+    loadDone.wait(lock, [&] { return loading.count(name) == 0; });
+    auto it = loaded.find(name);
+    if (it == loaded.end()) {
+        return 0;
+    }
+    int changed = it->second.wad->refresh();
+    if (changed < 0) {
+        // unreadable for now, the next access loads whatever is there then
+        memoryUsed -= it->second.memory;
+        recent.erase(it->second.recent);
+        loaded.erase(it);
+        return -1;
+    }
+    account(it->second);
+    return changed;
+}
+
+int WadLibrary::getDirectory(std::vector<std::string> *entries) {
+    std::error_code error;
+    std::filesystem::directory_iterator it(directory, error);
+    if (error) {
+        return -1;
+    }
+    size_t first = entries->size();
+    for (const auto& entry : it) {
+        std::string name = entry.path().filename().string();
+        if (isWadName(name) && entry.is_regular_file(error)) {
+            entries->push_back(name);
+        }
+    }
+    std::sort(entries->begin() + first, entries->end());
+    return entries->size();
+}
+
+size_t WadLibrary::getMemoryUsage() {
+    std::lock_guard<std::mutex> lock(libraryLock);
+    return memoryUsed;
+}
+
+size_t WadLibrary::getLoadedCount() {
+    std::lock_guard<std::mutex> lock(libraryLock);
+    return loaded.size();
+}
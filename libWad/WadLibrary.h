@@ -0,0 +1,63 @@
+#pragma once
+
+#include "WadOverlay.h"
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+
+// serves every .wad file in a host directory as its own subdirectory
+// archives are loaded on first access and the least recently used ones are dropped, index and
+// file descriptor both, once resident archives exceed the memory budget or too many are open
+// an archive's cost (index, new lumps, block and image caches) is measured again each time it is
+// handed out, so growth after loading counts against the budget too
+// every method may be called from several threads, an archive a caller still holds is not evicted
+class WadLibrary {
+    struct Archive {
+        std::shared_ptr<WadOverlay> wad;
+        size_t memory;
+        std::list<std::string>::iterator recent;
+    };
+
+    std::string directory;
+    size_t memoryLimit;
+    size_t openLimit;
+    size_t memoryUsed;
+    bool deduplicate = false;
+    // one image view cache for every archive, null while views are off
+    std::shared_ptr<WadImages> images;
+    bool mappedWrites = false;
+    std::mutex libraryLock;
+    std::unordered_map<std::string, Archive> loaded;
+    // archives being read without the lock, a second caller waits on loadDone instead of reading
+    // the same file again
+    std::unordered_set<std::string> loading;
+    std::condition_variable loadDone;
+    // most recently used first
+    std::list<std::string> recent;
+
+    private:
+        // constructor
+        WadLibrary(const std::string &dir, size_t memoryLimit, size_t openLimit);
+        void account(Archive &archive);
+        void evict(const std::string &keep);
+
+    public:
+        static bool isWadName(const std::string &name);
+        static WadLibrary* loadLibrary(const std::string &dir, size_t memoryLimit, size_t openLimit);
+        ~WadLibrary();
+        std::shared_ptr<WadOverlay> acquire(const std::string &name);
+        // re-reads an archive another program changed, nothing to do if it is not resident
+        int refresh(const std::string &name);
+        int getDirectory(std::vector<std::string> *entries);
+        size_t getMemoryUsage();
+        size_t getLoadedCount();
+        // applies to archives loaded from now on as well as the resident ones
+        void setDeduplication(bool enabled);
+        // one image view cache of cacheBytes shared by every archive, see WadOverlay::setImageViews
+        void setImageViews(size_t cacheBytes);
+        void setMappedWrites(bool enabled);
+        // flushes every resident archive, -1 if any of them failed
+        int flush();
+};
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+// the one place descriptor names are classified, so the loader, lookups, writers and tools agree
+//   X_START / X_END  namespace markers, the directory is called X
+//   E#M# / MAP##     map markers (Doom / Doom II), the lumps right after one belong to its map for as
+//                    long as their names are map lumps in map order, which sizes a map by what it
+//                    contains instead of assuming the 10 classic lumps
+// names are packed into one little endian word and matched against tables built at compile time,
+// classifying never allocates and is a few masks and compares
+enum class WadNameKind : uint8_t {
+    Lump,
+    NamespaceStart,
+    NamespaceEnd,
+    MapMarker,
+};
+
+class WadNames {
+    static constexpr uint8_t Digit = 1;
+
+    static constexpr std::array<uint8_t, 256> classes = [] {
+        std::array<uint8_t, 256> table = {};
+        for (int c = '0'; c <= '9'; ++c) {
+            table[c] |= Digit;
+        }
+        return table;
+    }();
+
+    static constexpr uint64_t mask(size_t bytes) {
+        return bytes >= 8 ? ~0ULL : (1ULL << (8 * bytes)) - 1;
+    }
+
+    static constexpr bool digitAt(uint64_t word, int position) {
+        return classes[(word >> (8 * position)) & 0xFF] & Digit;
+    }
+
+    static constexpr bool endsWith(uint64_t word, size_t size, uint64_t suffix, size_t suffixSize) {
+        return size >= suffixSize && ((word >> (8 * (size - suffixSize))) & mask(suffixSize)) == suffix;
+    }
+
+    // in the order engines expect them, defined below the class since it is built with pack
+    static const std::array<uint64_t, 25> mapLumps;
+
+    static constexpr int rankOf(uint64_t word) {
+        int rank = -1;
+        for (size_t i = 0; i < mapLumps.size(); ++i) {
+            rank = mapLumps[i] == word ? static_cast<int>(i) : rank;
+        }
+        return rank;
+    }
+
+    public:
+        // first 8 bytes of name, zero padded like the descriptor field
+        static constexpr uint64_t pack(std::string_view name) {
+            uint64_t word = 0;
+            for (size_t i = 0; i < name.size() && i < 8; ++i) {
+                word |= static_cast<uint64_t>(static_cast<uint8_t>(name[i])) << (8 * i);
+            }
+            return word;
+        }
+
+        static constexpr bool isMapMarker(std::string_view name) {
+            uint64_t word = pack(name);
+            bool episode = name.size() == 4 && (word & 0xFFFFFFFF00FF00FFULL) == 0x4D0045 && digitAt(word, 1) && digitAt(word, 3);
+            bool level = name.size() == 5 && (word & 0xFFFFFF0000FFFFFFULL) == 0x50414D && digitAt(word, 3) && digitAt(word, 4);
+            return episode || level;
+        }
+
+        static constexpr WadNameKind classify(std::string_view name) {
+            if (name.size() > 8) {
+                return WadNameKind::Lump;
+            }
+            uint64_t word = pack(name);
+            if (endsWith(word, name.size(), pack("_START"), 6)) {
+                return WadNameKind::NamespaceStart;
+            }
+            if (endsWith(word, name.size(), pack("_END"), 4)) {
+                return WadNameKind::NamespaceEnd;
+            }
+            return isMapMarker(name) ? WadNameKind::MapMarker : WadNameKind::Lump;
+        }
+
+        static constexpr bool isNamespaceStart(std::string_view name) {
+            return classify(name) == WadNameKind::NamespaceStart;
+        }
+
+        static constexpr bool isNamespaceEnd(std::string_view name) {
+            return classify(name) == WadNameKind::NamespaceEnd;
+        }
+
+        // position among the map lumps, -1 for anything that cannot be part of a map
+        static constexpr int mapLumpRank(std::string_view name) {
+            if (name.size() > 8) {
+                return -1;
+            }
+            uint64_t word = pack(name);
+            if ((word & mask(3)) == pack("GL_") && isMapMarker(name.substr(3))) {
+                word = pack("GL_");
+            }
+            return rankOf(word);
+        }
+
+        static constexpr bool isMapLump(std::string_view name) {
+            return mapLumpRank(name) >= 0;
+        }
+
+        // where a map stands once name follows the lump ranked last (-1 right behind the marker),
+        // or -1 when name ends it: classic maps keep the table order above, a UDMF map takes any
+        // map lump between its TEXTMAP and ENDMAP
+        static constexpr int nextMapRank(int last, std::string_view name) {
+            int rank = mapLumpRank(name);
+            int end = static_cast<int>(mapLumps.size()) - 1;
+            if (last == 0 && rank > 0) {
+                return rank == end ? end : 0;
+            }
+            return rank > last ? rank : -1;
+        }
+
+        // glob match of a whole name, '*' is any run of characters and '?' any one character
+        static constexpr bool matches(std::string_view pattern, std::string_view name) {
+            size_t p = 0, n = 0;
+            size_t star = std::string_view::npos, resume = 0;
+            while (n < name.size()) {
+                if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+                    p++;
+                    n++;
+                } else if (p < pattern.size() && pattern[p] == '*') {
+                    star = p++;
+                    resume = n;
+                } else if (star != std::string_view::npos) {
+                    p = star + 1;
+                    n = ++resume;
+                } else {
+                    return false;
+                }
+            }
+            while (p < pattern.size() && pattern[p] == '*') {
+                p++;
+            }
+            return p == pattern.size();
+        }
+
+        // the path component a descriptor name stands for, markers lose their suffix
+        static constexpr std::string_view pathName(std::string_view name) {
+            switch (classify(name)) {
+                case WadNameKind::NamespaceStart:
+                    return name.substr(0, name.size() - 6);
+                case WadNameKind::NamespaceEnd:
+                    return name.substr(0, name.size() - 4);
+                default:
+                    return name;
+            }
+        }
+};
+
+// "GL_" stands for the GL_<map> marker of a GL nodes block
+// UDMF maps open with TEXTMAP and close with ENDMAP, classic maps never contain either
+inline constexpr std::array<uint64_t, 25> WadNames::mapLumps = {
+    WadNames::pack("TEXTMAP"), WadNames::pack("THINGS"), WadNames::pack("LINEDEFS"), WadNames::pack("SIDEDEFS"),
+    WadNames::pack("VERTEXES"), WadNames::pack("SEGS"), WadNames::pack("SSECTORS"), WadNames::pack("NODES"),
+    WadNames::pack("SECTORS"), WadNames::pack("REJECT"), WadNames::pack("BLOCKMAP"), WadNames::pack("BEHAVIOR"),
+    WadNames::pack("SCRIPTS"), WadNames::pack("ZNODES"), WadNames::pack("DIALOGUE"), WadNames::pack("LEAFS"),
+    WadNames::pack("LIGHTS"), WadNames::pack("MACROS"), WadNames::pack("GL_"), WadNames::pack("GL_VERT"),
+    WadNames::pack("GL_SEGS"), WadNames::pack("GL_SSECT"), WadNames::pack("GL_NODES"), WadNames::pack("GL_PVS"),
+    WadNames::pack("ENDMAP"),
+};
+
+static_assert(WadNames::classify("F1_START") == WadNameKind::NamespaceStart, "namespace start");
+static_assert(WadNames::classify("F_END") == WadNameKind::NamespaceEnd, "namespace end");
+static_assert(WadNames::classify("E1M1") == WadNameKind::MapMarker && WadNames::classify("MAP01") == WadNameKind::MapMarker, "map markers");
+static_assert(WadNames::classify("E1M10") == WadNameKind::Lump && WadNames::classify("MAPXY") == WadNameKind::Lump, "not map markers");
+static_assert(WadNames::matches("TROO*", "TROOA1") && WadNames::matches("*A?", "TROOA1") && !WadNames::matches("TROO?", "TROOA1"), "globs");
+static_assert(WadNames::isMapLump("BEHAVIOR") && WadNames::isMapLump("GL_MAP01") && !WadNames::isMapLump("PLAYPAL"), "map lumps");
+static_assert(WadNames::nextMapRank(WadNames::nextMapRank(-1, "THINGS"), "SECTORS") > 0 && WadNames::nextMapRank(WadNames::nextMapRank(-1, "SECTORS"), "THINGS") < 0, "map lump order");
+static_assert(WadNames::nextMapRank(WadNames::nextMapRank(0, "ZNODES"), "REJECT") == 0 && WadNames::nextMapRank(WadNames::nextMapRank(0, "ENDMAP"), "THINGS") < 0, "udmf maps");
@@ -0,0 +1,651 @@
+#include "WadOverlay.h"
+
+static bool isEndMarker(Node* node) {
+    return !node->isFile && WadNames::isNamespaceEnd(node->filename);
+}
+
+static std::string parentPath(const std::string &path) {
+    size_t pos = path.find_last_of('/');
+    return pos == 0 ? "/" : path.substr(0, pos);
+}
+
+WadOverlay::WadOverlay(const std::vector<Wad*> &wads) : layers(wads) {
+    buildIndex();
+}
+
+// merged index from scratch, walking layers bottom to top so later layers win
+void WadOverlay::buildIndex() {
+    index.clear();
+    listings.clear();
+    for (Wad* layer : layers) {
+        index["/"] = Entry{layer, layer->getRoot()};
+        addNode(layer, layer->getRoot());
+    }
+}
+
+WadOverlay* WadOverlay::loadOverlay(const std::vector<std::string> &paths) {
+    std::vector<Wad*> wads;
+    for (const std::string& path : paths) {
+        Wad* wad = Wad::loadWad(path);
+        if (!wad) {
+            for (Wad* loaded : wads) {
+                delete loaded;
+            }
+            return nullptr;
+        }
+        wads.push_back(wad);
+    }
+    if (wads.empty()) {
+        return nullptr;
+    }
+    return new WadOverlay(wads);
+}
+
+WadOverlay::~WadOverlay() {
+    // drop views before the nodes they point into
+    index.clear();
+    listings.clear();
+    for (Wad* layer : layers) {
+        delete layer;
+    }
+    if (images) {
+        images->clear(this);
+    }
+}
+
+size_t WadOverlay::getMemoryUsage() {
+    size_t bytes = sizeof(WadOverlay);
+    for (Wad* layer : layers) {
+        bytes += layer->getMemoryUsage();
+    }
+    {
+        // rough per-entry cost of the hash tables and listing vectors
+        std::shared_lock<std::shared_mutex> lock(indexLock);
+        bytes += index.size() * (sizeof(std::string_view) + sizeof(Entry) + 2 * sizeof(void*));
+        bytes += listings.size() * (sizeof(std::string_view) + sizeof(std::vector<Child>) + 2 * sizeof(void*));
+        bytes += index.size() * sizeof(Child);
+    }
+    // only this overlay's views, a shared cache is charged to the archives that filled it
+    bytes += images ? images->getMemoryUsage(this) : 0;
+    return bytes;
+}
+
+void WadOverlay::setDeduplication(bool enabled) {
+    layers.back()->setDeduplication(enabled);
+}
+
+bool WadOverlay::setMappedWrites(bool enabled) {
+    return layers.back()->setMappedWrites(enabled);
+}
+
+int WadOverlay::flush() {
+    return layers.back()->flush();
+}
+
+bool WadOverlay::isReadOnly() {
+    return layers.back()->isReadOnly();
+}
+
+void WadOverlay::setImageViews(size_t cacheBytes) {
+    setImageViews(cacheBytes ? std::make_shared<WadImages>(cacheBytes) : nullptr);
+}
+
+void WadOverlay::setImageViews(const std::shared_ptr<WadImages> &cache) {
+    if (images) {
+        images->clear(this);
+    }
+    images = cache;
+}
+
+// a changed lump loses its view, a changed palette every view
+// called once the change is in the archive, under imageLock so a conversion that still read the
+// old bytes stores its view before it is dropped
+void WadOverlay::dropImage(const std::string &path) {
+    if (!images) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(imageLock);
+    if (path == "/PLAYPAL") {
+        images->clear(this);
+    } else {
+        images->invalidate(this, path);
+    }
+}
+
+bool WadOverlay::isImage(std::string_view path) {
+    std::string_view source = images ? WadImages::sourceOf(path) : std::string_view();
+    return !source.empty() && isContent(source);
+}
+
+off_t WadOverlay::getImageSize(std::string_view path) {
+    std::string_view source = images ? WadImages::sourceOf(path) : std::string_view();
+    Entry entry;
+    if (source.empty() || !lookupEntry(source, entry) || !entry.node->isFile) {
+        return -1;
+    }
+    int64_t cached = images->getSize(this, entry.node->fullPath);
+    if (cached >= 0) {
+        return cached;
+    }
+    // pictures carry their size in the first 4 bytes, flats in their length
+    char header[4];
+    ssize_t got = WadImages::isFlat(source) ? 0 : entry.layer->getContents(entry.node, header, sizeof(header), 0);
+    return WadImages::viewSize(source, header, got < 0 ? 0 : got, entry.layer->getSize(entry.node));
+}
+
+ssize_t WadOverlay::getImage(std::string_view path, char *buffer, size_t length, off_t offset) {
+    WadStatsTimer timer(WadStats::GetImage);
+    std::string_view source = images ? WadImages::sourceOf(path) : std::string_view();
+    Entry entry;
+    if (source.empty() || !lookupEntry(source, entry) || !entry.node->isFile || offset < 0) {
+        return -1;
+    }
+    ssize_t copied = images->read(this, entry.node->fullPath, buffer, length, offset);
+    if (copied >= 0) {
+        return copied;
+    }
+    // one conversion at a time, a second reader of the same view finds it cached
+    std::lock_guard<std::mutex> lock(imageLock);
+    copied = images->read(this, entry.node->fullPath, buffer, length, offset);
+    if (copied < 0) {
+        std::vector<char> lump(entry.layer->getSize(entry.node));
+        std::vector<char> palette(768);
+        bool hasPalette = getContents("/PLAYPAL", palette.data(), palette.size()) == static_cast<ssize_t>(palette.size());
+        std::vector<char> converted;
+        if (entry.layer->getContents(entry.node, lump.data(), lump.size()) != static_cast<ssize_t>(lump.size()) ||
+            !WadImages::convert(source, lump, hasPalette ? palette.data() : nullptr, &converted)) {
+            return -1;
+        }
+        WadStats::add(WadStats::ImagesConverted);
+        copied = images->store(this, entry.node->fullPath, std::move(converted), buffer, length, offset);
+    }
+    return copied;
+}
+
+void WadOverlay::addNode(Wad* layer, Node* node) {
+    for (Node* child : node->children) {
+        if (isEndMarker(child)) {
+            continue;
+        }
+        indexNode(layer, child);
+        if (!child->isFile) {
+            addNode(layer, child);
+        }
+    }
+}
+
+void WadOverlay::indexNode(Wad* layer, Node* node) {
+    std::string_view path = node->fullPath;
+    auto it = index.find(path);
+    if (it == index.end()) {
+        Entry* entry = &index.emplace(path, Entry{layer, node}).first->second;
+        std::string_view parent = node->parent->fullPath;
+        // the last component runs to the end of fullPath, so the view stays nul terminated
+        listings[parent].push_back(Child{path.substr(path.find_last_of('/') + 1), entry});
+        return;
+    }
+    // a lump shadowing a namespace hides everything that was under it
+    if (!it->second.node->isFile && node->isFile) {
+        removeSubtree(node->fullPath);
+    }
+    it->second = Entry{layer, node};
+}
+
+void WadOverlay::removeSubtree(const std::string &path) {
+    auto listing = listings.find(path);
+    if (listing == listings.end()) {
+        return;
+    }
+    std::vector<Child> children = std::move(listing->second);
+    listings.erase(listing);
+    for (const Child& child : children) {
+        std::string childPath = path + "/" + std::string(child.name);
+        removeSubtree(childPath);
+        index.erase(childPath);
+    }
+}
+
+// drops path and everything under it from the index and from its parent's listing
+void WadOverlay::unindex(const std::string &path) {
+    removeSubtree(path);
+    auto it = index.find(path);
+    if (it == index.end()) {
+        return;
+    }
+    Entry* entry = &it->second;
+    auto listing = listings.find(parentPath(path));
+    if (listing != listings.end()) {
+        std::vector<Child>& children = listing->second;
+        children.erase(std::remove_if(children.begin(), children.end(), [&](const Child &child) {
+            return child.entry == entry;
+        }), children.end());
+    }
+    index.erase(it);
+}
+
+void WadOverlay::reindex(Wad* layer, const std::string &path) {
+    Node* node = layer->getNode(path);
+    if (!node) {
+        return;
+    }
+    indexNode(layer, node);
+    if (!node->isFile) {
+        addNode(layer, node);
+    }
+}
+
+bool WadOverlay::onlyInTop(const std::string &path) {
+    for (size_t i = 0; i + 1 < layers.size(); ++i) {
+        if (layers[i]->getNode(path)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int WadOverlay::refresh() {
+    int changed = 0;
+    bool rebuild = false;
+    for (Wad* layer : layers) {
+        std::vector<Node*> added;
+        // a single layer owns every entry, so its dropped and added subtrees map straight onto the
+        // index, with several layers a dropped entry may uncover a lower one and the index is rebuilt
+        std::function<void(Node*)> dropping = [&](Node* node) {
+            if (layers.size() == 1 && !isEndMarker(node)) {
+                unindex(node->fullPath);
+            }
+        };
+        int layerChanged = layer->refresh(dropping, &added);
+        if (layerChanged < 0) {
+            return -1;
+        }
+        changed += layerChanged;
+        if (layers.size() > 1) {
+            rebuild = rebuild || layerChanged > 0;
+            continue;
+        }
+        for (Node* node : added) {
+            if (!isEndMarker(node)) {
+                indexNode(layer, node);
+                if (!node->isFile) {
+                    addNode(layer, node);
+                }
+            }
+        }
+    }
+    if (rebuild) {
+        buildIndex();
+    }
+    if (images && changed > 0) {
+        images->clear(this);
+    }
+    return changed;
+}
+
+std::string WadOverlay::normalize(std::string_view path) {
+    std::string normalized;
+    size_t start = 0;
+    while (start < path.size()) {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        if (end > start) {
+            normalized += "/";
+            normalized.append(path, start, end - start);
+        }
+        start = end + 1;
+    }
+    return normalized.empty() ? "/" : normalized;
+}
+
+// already in the form normalize produces: leading "/", no empty components, no trailing "/"
+static bool isNormalized(std::string_view path) {
+    if (path.empty() || path[0] != '/') {
+        return false;
+    }
+    if (path.size() == 1) {
+        return true;
+    }
+    return path.back() != '/' && path.find("//") == std::string_view::npos;
+}
+
+// paths from fuse are already normalized, only the others are copied into storage
+static std::string_view normalized(std::string_view path, std::string &storage) {
+    if (isNormalized(path)) {
+        return path;
+    }
+    storage = WadOverlay::normalize(path);
+    return storage;
+}
+
+WadOverlay::Entry* WadOverlay::find(std::string_view path) {
+    WadStatsTimer timer(WadStats::Lookup);
+    WadStats::add(WadStats::Lookups);
+    auto it = index.find(path);
+    return it == index.end() ? nullptr : &it->second;
+}
+
+// find for the calls that may run concurrently, the entry is copied while the index is locked
+bool WadOverlay::lookupEntry(std::string_view path, Entry &entry) {
+    std::string storage;
+    std::string_view normal = normalized(path, storage);
+    std::shared_lock<std::shared_mutex> lock(indexLock);
+    Entry* found = find(normal);
+    if (!found) {
+        return false;
+    }
+    entry = *found;
+    return true;
+}
+
+std::string WadOverlay::getMagic() {
+    return layers.front()->getMagic();
+}
+
+bool WadOverlay::isContent(std::string_view path) {
+    if (path.empty() || path.back() == '/') {
+        return false;
+    }
+    Entry entry;
+    return lookupEntry(path, entry) && entry.node->isFile;
+}
+
+bool WadOverlay::isDirectory(std::string_view path) {
+    if (path.empty()) {
+        return false;
+    }
+    Entry entry;
+    return lookupEntry(path, entry) && !entry.node->isFile;
+}
+
+off_t WadOverlay::getSize(std::string_view path) {
+    Entry entry;
+    if (!lookupEntry(path, entry) || !entry.node->isFile) {
+        return -1;
+    }
+    return entry.layer->getSize(entry.node);
+}
+
+ssize_t WadOverlay::getContents(std::string_view path, char *buffer, size_t length, off_t offset) {
+    Entry entry;
+    if (!lookupEntry(path, entry) || !entry.node->isFile) {
+        return -1;
+    }
+    return entry.layer->getContents(entry.node, buffer, length, offset);
+}
+
+int WadOverlay::findLumps(std::string_view pattern, std::vector<std::string_view> *paths) {
+    size_t before = paths->size();
+    std::vector<Node*> matches;
+    std::shared_lock<std::shared_mutex> lock(indexLock);
+    for (Wad* layer : layers) {
+        matches.clear();
+        if (layer->findLumps(pattern, &matches) < 0) {
+            return -1;
+        }
+        // a lump shadowed by a higher layer is not what the path shows
+        for (Node* node : matches) {
+            Entry* entry = find(node->fullPath);
+            if (entry && entry->node == node) {
+                paths->push_back(node->fullPath);
+            }
+        }
+    }
+    return paths->size() - before;
+}
+
+bool WadOverlay::getExtent(std::string_view path, WadExtent *extent) {
+    Entry entry;
+    return lookupEntry(path, entry) && entry.layer->getExtent(entry.node, extent);
+}
+
+bool WadOverlay::getChecksum(std::string_view path, uint32_t &crc) {
+    Entry entry;
+    return lookupEntry(path, entry) && entry.layer->getChecksum(entry.node, crc);
+}
+
+int WadOverlay::getDirectory(std::string_view path, std::vector<std::string> *directory) {
+    if (path.empty()) {
+        return -1;
+    }
+    std::string storage;
+    std::string_view dirPath = normalized(path, storage);
+    Entry* entry = find(dirPath);
+    if (!entry || entry->node->isFile) {
+        return -1;
+    }
+    auto listing = listings.find(dirPath);
+    if (listing != listings.end()) {
+        for (const Child& child : listing->second) {
+            directory->emplace_back(child.name);
+        }
+    }
+    return directory->size();
+}
+
+int WadOverlay::readDirectory(std::string_view path, size_t position, const std::function<bool(const char *name, bool isFile, size_t next)> &emit) {
+    if (path.empty()) {
+        return -1;
+    }
+    std::string storage;
+    std::string_view dirPath = normalized(path, storage);
+    // creates append to listings under the exclusive lock
+    std::shared_lock<std::shared_mutex> lock(indexLock);
+    Entry* entry = find(dirPath);
+    if (!entry || entry->node->isFile) {
+        return -1;
+    }
+    auto listing = listings.find(dirPath);
+    if (listing == listings.end()) {
+        return 0;
+    }
+    const std::vector<Child>& children = listing->second;
+    for (size_t i = position; i < children.size(); ++i) {
+        if (!emit(children[i].name.data(), children[i].entry->node->isFile, i + 1)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+bool WadOverlay::ensureDirectory(const std::string &path) {
+    // copy the namespace chain up into the top layer so new entries have somewhere to go
+    Wad* top = layers.back();
+    std::string current;
+    size_t start = 1;
+    while (start < path.size()) {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        current = path.substr(0, end);
+        if (!top->getNode(current)) {
+            Node* created = top->createDirectory(current);
+            if (!created || created->isFile) {
+                return false;
+            }
+            indexNode(top, created);
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+// new entries are made in the top layer without holding the index, which is only locked to
+// check the parent, to copy a namespace up from a lower layer and to add the result
+bool WadOverlay::prepareParent(const std::string &path) {
+    Entry entry;
+    if (lookupEntry(path, entry) || !lookupEntry(parentPath(path), entry) || entry.node->isFile) {
+        return false;
+    }
+    if (entry.layer == layers.back()) {
+        return true;
+    }
+    std::unique_lock<std::shared_mutex> lock(indexLock);
+    return ensureDirectory(parentPath(path));
+}
+
+void WadOverlay::createDirectory(const std::string &path) {
+    std::string dirPath = normalize(path);
+    if (!prepareParent(dirPath)) {
+        return;
+    }
+    Wad* top = layers.back();
+    Node* created = top->createDirectory(dirPath);
+    if (created && !created->isFile) {
+        std::unique_lock<std::shared_mutex> lock(indexLock);
+        indexNode(top, created);
+    }
+}
+
+void WadOverlay::createFile(const std::string &path) {
+    std::string filePath = normalize(path);
+    if (!prepareParent(filePath)) {
+        return;
+    }
+    Wad* top = layers.back();
+    Node* created = top->createFile(filePath);
+    if (created && created->isFile) {
+        std::unique_lock<std::shared_mutex> lock(indexLock);
+        indexNode(top, created);
+    }
+}
+
+ssize_t WadOverlay::writeToFile(const std::string &path, const char *buffer, size_t length, off_t offset) {
+    std::string filePath = normalize(path);
+    Entry entry;
+    if (!lookupEntry(filePath, entry) || !entry.node->isFile) {
+        return -1;
+    }
+    Wad* top = layers.back();
+    if (entry.layer != top) {
+        std::unique_lock<std::shared_mutex> lock(indexLock);
+        Entry* copied = copyUp(filePath);
+        if (!copied) {
+            return -1;
+        }
+        entry = *copied;
+    }
+    ssize_t written = top->writeToFile(entry.node, buffer, length, offset);
+    dropImage(filePath);
+    return written;
+}
+
+// the lump lives in a lower layer, give it an empty descriptor in the top layer that shadows it
+WadOverlay::Entry* WadOverlay::copyUp(const std::string &path) {
+    Wad* top = layers.back();
+    if (!ensureDirectory(parentPath(path))) {
+        return nullptr;
+    }
+    Node* created = top->createFile(path);
+    if (!created || !created->isFile) {
+        return nullptr;
+    }
+    Entry* entry = find(path);
+    *entry = Entry{top, created};
+    return entry;
+}
+
+int WadOverlay::removeFile(const std::string &path) {
+    std::string filePath = normalize(path);
+    Entry* entry = find(filePath);
+    Wad* top = layers.back();
+    if (!entry || !entry->node->isFile || entry->layer != top || !onlyInTop(filePath)) {
+        return -1;
+    }
+    // the index holds views into the node, so it goes first
+    unindex(filePath);
+    if (top->removeFile(filePath) < 0) {
+        reindex(top, filePath);
+        return -1;
+    }
+    dropImage(filePath);
+    return 0;
+}
+
+int WadOverlay::removeDirectory(const std::string &path) {
+    std::string dirPath = normalize(path);
+    Entry* entry = find(dirPath);
+    Wad* top = layers.back();
+    if (!entry || entry->node->isFile || dirPath == "/" || entry->layer != top || !onlyInTop(dirPath)) {
+        return -1;
+    }
+    auto listing = listings.find(dirPath);
+    if (listing != listings.end() && !listing->second.empty()) {
+        return -1;
+    }
+    unindex(dirPath);
+    if (top->removeDirectory(dirPath) < 0) {
+        reindex(top, dirPath);
+        return -1;
+    }
+    return 0;
+}
+
+int WadOverlay::renamePath(const std::string &from, const std::string &to) {
+    std::string fromPath = normalize(from);
+    std::string toPath = normalize(to);
+    Entry* entry = find(fromPath);
+    Wad* top = layers.back();
+    if (!entry || fromPath == "/" || entry->layer != top || !onlyInTop(fromPath) || !isDirectory(parentPath(toPath))) {
+        return -1;
+    }
+    Entry* existing = find(toPath);
+    if (existing && (existing->layer != top || !onlyInTop(toPath))) {
+        return -1;
+    }
+    bool replacing = existing != nullptr;
+    if (!ensureDirectory(parentPath(toPath))) {
+        return -1;
+    }
+    unindex(fromPath);
+    if (replacing) {
+        unindex(toPath);
+    }
+    int result = top->renamePath(fromPath, toPath);
+    if (result < 0) {
+        reindex(top, fromPath);
+        if (replacing) {
+            reindex(top, toPath);
+        }
+        return -1;
+    }
+    reindex(top, toPath);
+    // a directory moves every view under it, and renames are rare enough to start over
+    if (images) {
+        std::lock_guard<std::mutex> lock(imageLock);
+        images->clear(this);
+    }
+    return 0;
+}
+
+int WadOverlay::truncateFile(const std::string &path, uint64_t length) {
+    std::string filePath = normalize(path);
+    Entry* entry = find(filePath);
+    if (!entry || !entry->node->isFile) {
+        return -1;
+    }
+    Wad* top = layers.back();
+    if (entry->layer == top) {
+        int result = top->truncateFile(filePath, length);
+        dropImage(filePath);
+        return result;
+    }
+    if (length > entry->node->length) {
+        return -1;
+    }
+    if (length == entry->node->length) {
+        return 0;
+    }
+    std::vector<char> prefix(length);
+    if (entry->layer->getContents(entry->node, prefix.data(), length) != static_cast<ssize_t>(length)) {
+        return -1;
+    }
+    if (!(entry = copyUp(filePath))) {
+        return -1;
+    }
+    int result = length == 0 || top->writeToFile(entry->node, prefix.data(), length) == static_cast<ssize_t>(length) ? 0 : -1;
+    dropImage(filePath);
+    return result;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "Wad.h"
+#include "WadImages.h"
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+
+// union view of a base IWAD with PWADs layered on top of it
+// later layers override lumps of the same path, namespaces present in several layers merge
+// every path is resolved through one index built at load time, so lookups do not probe each layer
+// writes and new entries always go to the last (top) layer
+class WadOverlay {
+    struct Entry {
+        Wad* layer;
+        Node* node;
+    };
+    // entries live in the index, whose elements never move, so overrides show up here too
+    struct Child {
+        std::string_view name;
+        Entry* entry;
+    };
+
+    std::vector<Wad*> layers;
+    // keys and names are views into Node::fullPath, nodes live as long as their layer
+    std::unordered_map<std::string_view, Entry> index;
+    // per directory children in load/creation order, extended by createFile and createDirectory
+    std::unordered_map<std::string_view, std::vector<Child>> listings;
+    // lookups hold indexLock shared, new and copied up entries take it exclusive
+    std::shared_mutex indexLock;
+    // converted graphics, null while image views are off, reads fill the cache and writes drop from it
+    // possibly shared with other overlays, views are kept under this overlay's address
+    std::shared_ptr<WadImages> images;
+    // one conversion at a time
+    std::mutex imageLock;
+
+    private:
+        // constructor
+        WadOverlay(const std::vector<Wad*> &wads);
+        void buildIndex();
+        void addNode(Wad* layer, Node* node);
+        void indexNode(Wad* layer, Node* node);
+        void removeSubtree(const std::string &path);
+        void unindex(const std::string &path);
+        void reindex(Wad* layer, const std::string &path);
+        bool onlyInTop(const std::string &path);
+        Entry* find(std::string_view path);
+        bool lookupEntry(std::string_view path, Entry &entry);
+        bool ensureDirectory(const std::string &path);
+        bool prepareParent(const std::string &path);
+        Entry* copyUp(const std::string &path);
+        void dropImage(const std::string &path);
+
+    public:
+        static std::string normalize(std::string_view path);
+        static WadOverlay* loadOverlay(const std::vector<std::string> &paths);
+        ~WadOverlay();
+        size_t getMemoryUsage();
+        // applies to the top layer, the only one written to
+        void setDeduplication(bool enabled);
+        // BMP views of sprites, patches and flats: NAME.bmp next to NAME, decoded with PLAYPAL on
+        // first read and kept until writes, truncates, removes or renames through this overlay
+        // change the lump, 0 turns the views off
+        void setImageViews(size_t cacheBytes);
+        // the same views kept in a cache other overlays use too, under one budget for all of them
+        void setImageViews(const std::shared_ptr<WadImages> &cache);
+        // see Wad::setMappedWrites and Wad::flush, both only concern the top layer
+        bool setMappedWrites(bool enabled);
+        int flush();
+        // the top layer could only be opened for reading, so nothing can be created or written
+        bool isReadOnly();
+        std::string getMagic();
+        // as in Wad, the string_view forms do the work and do not allocate for already normalized paths
+        bool isContent(std::string_view path);
+        bool isContent(const std::string &path) { return isContent(std::string_view(path)); }
+        bool isContent(const char *path) { return isContent(std::string_view(path)); }
+        bool isDirectory(std::string_view path);
+        bool isDirectory(const std::string &path) { return isDirectory(std::string_view(path)); }
+        bool isDirectory(const char *path) { return isDirectory(std::string_view(path)); }
+        off_t getSize(std::string_view path);
+        off_t getSize(const std::string &path) { return getSize(std::string_view(path)); }
+        off_t getSize(const char *path) { return getSize(std::string_view(path)); }
+        ssize_t getContents(std::string_view path, char *buffer, size_t length, off_t offset = 0);
+        ssize_t getContents(const std::string &path, char *buffer, size_t length, off_t offset = 0) { return getContents(std::string_view(path), buffer, length, offset); }
+        ssize_t getContents(const char *path, char *buffer, size_t length, off_t offset = 0) { return getContents(std::string_view(path), buffer, length, offset); }
+        int getDirectory(std::string_view path, std::vector<std::string> *directory);
+        int getDirectory(const std::string &path, std::vector<std::string> *directory) { return getDirectory(std::string_view(path), directory); }
+        int getDirectory(const char *path, std::vector<std::string> *directory) { return getDirectory(std::string_view(path), directory); }
+        // paths of the visible lumps whose name matches pattern, see Wad::findLumps
+        // the views point into the nodes and are invalidated like listings
+        int findLumps(std::string_view pattern, std::vector<std::string_view> *paths);
+        // physical location and checksum of whichever layer serves the lump
+        bool getExtent(std::string_view path, WadExtent *extent);
+        bool getChecksum(std::string_view path, uint32_t &crc);
+        // a view path (see WadImages::sourceOf) whose lump exists, sized from the picture header
+        bool isImage(std::string_view path);
+        off_t getImageSize(std::string_view path);
+        ssize_t getImage(std::string_view path, char *buffer, size_t length, off_t offset = 0);
+        // streams the cached listing from position on without copying it, stops once emit returns false
+        // names are nul terminated views into the nodes, next is the position after this child
+        // emit runs with the index locked shared, so it must not call back into the overlay's writers
+        int readDirectory(std::string_view path, size_t position, const std::function<bool(const char *name, bool isFile, size_t next)> &emit);
+        // as in Wad, these three may run on several threads at once, alongside isContent,
+        // isDirectory, getSize, getContents and the image views, the rest needs the overlay to itself
+        void createDirectory(const std::string &path);
+        void createFile(const std::string &path);
+        ssize_t writeToFile(const std::string &path, const char *buffer, size_t length, off_t offset = 0);
+        // lower layers are read only and WAD has no whiteouts, so removes and renames only apply
+        // to entries the top layer alone provides, truncating a lower lump copies its prefix up
+        int removeFile(const std::string &path);
+        int removeDirectory(const std::string &path);
+        int renamePath(const std::string &from, const std::string &to);
+        int truncateFile(const std::string &path, uint64_t length);
+        // picks up changes other programs made to the layer files, see Wad::refresh
+        // returns the number of descriptors that changed, -1 if a layer could not be re-read
+        int refresh();
+};
@@ -0,0 +1,172 @@
+#include "WadStats.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <vector>
+
+// values below 16 get exact buckets, above that every power of two is split into 16 sub-buckets,
+// so any recorded latency is within 1/16 of its bucket bound
+static const size_t bucketCount = 61 * 16;
+
+static const char* counterNames[WadStats::CounterCount] = {"bytes_read", "bytes_written", "lookups", "descriptor_rewrites", "directory_relocations", "bytes_deduplicated", "bytes_reused", "descriptors_refreshed", "images_converted"};
+static const char* timerNames[WadStats::TimerCount] = {"getattr", "readdir", "read", "write", "mknod", "mkdir", "unlink", "rmdir", "rename", "truncate", "getxattr", "listxattr", "readlink", "fsync", "lookup", "getContents", "getDirectory", "createFile", "createDirectory", "writeToFile", "removeFile", "removeDirectory", "renamePath", "truncateFile", "findLumps", "refresh", "getImage"};
+
+struct ThreadStats {
+    std::atomic<uint64_t> counters[WadStats::CounterCount] = {};
+    std::atomic<uint64_t> counts[WadStats::TimerCount] = {};
+    std::atomic<uint64_t> sums[WadStats::TimerCount] = {};
+    std::atomic<uint64_t> maxima[WadStats::TimerCount] = {};
+    std::atomic<uint64_t> buckets[WadStats::TimerCount][bucketCount] = {};
+};
+
+// adds one block into another, only called with registryLock held
+static void fold(ThreadStats &into, const ThreadStats &from) {
+    for (size_t i = 0; i < WadStats::CounterCount; ++i) {
+        into.counters[i].store(into.counters[i].load(std::memory_order_relaxed) + from.counters[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    for (size_t t = 0; t < WadStats::TimerCount; ++t) {
+        into.counts[t].store(into.counts[t].load(std::memory_order_relaxed) + from.counts[t].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        into.sums[t].store(into.sums[t].load(std::memory_order_relaxed) + from.sums[t].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        into.maxima[t].store(std::max(into.maxima[t].load(std::memory_order_relaxed), from.maxima[t].load(std::memory_order_relaxed)), std::memory_order_relaxed);
+        for (size_t b = 0; b < bucketCount; ++b) {
+            into.buckets[t][b].store(into.buckets[t][b].load(std::memory_order_relaxed) + from.buckets[t][b].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    }
+}
+
+// live threads' blocks are in registry, a thread that exits folds its block into retired and leaves
+// it zeroed in spare for the next new thread, so fuse and worker pools that keep starting threads
+// hold one block per thread alive at a time
+static std::mutex registryLock;
+static std::vector<ThreadStats*> registry;
+static std::vector<ThreadStats*> spare;
+static ThreadStats retired;
+
+struct ThreadSlot {
+    ThreadStats* stats = nullptr;
+
+    ~ThreadSlot() {
+        if (!stats) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(registryLock);
+        fold(retired, *stats);
+        registry.erase(std::find(registry.begin(), registry.end(), stats));
+        // placement new resets every atomic to zero
+        stats->~ThreadStats();
+        spare.push_back(new (stats) ThreadStats());
+        stats = nullptr;
+    }
+};
+
+static ThreadStats* threadStats() {
+    thread_local ThreadSlot slot;
+    if (!slot.stats) {
+        std::lock_guard<std::mutex> lock(registryLock);
+        if (spare.empty()) {
+            slot.stats = new ThreadStats();
+        } else {
+            slot.stats = spare.back();
+            spare.pop_back();
+        }
+        registry.push_back(slot.stats);
+    }
+    return slot.stats;
+}
+
+// only the owning thread writes, so a plain load/store pair is enough and avoids locked adds
+static inline void bump(std::atomic<uint64_t>& value, uint64_t amount) {
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+static size_t bucketOf(uint64_t value) {
+    if (value < 16) {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    return (msb - 3) * 16 + ((value >> (msb - 4)) & 15);
+}
+
+static uint64_t bucketValue(size_t bucket) {
+    if (bucket < 16) {
+        return bucket;
+    }
+    int msb = bucket / 16 + 3;
+    return (16 + bucket % 16) << (msb - 4);
+}
+
+void WadStats::add(Counter counter, uint64_t amount) {
+    bump(threadStats()->counters[counter], amount);
+}
+
+void WadStats::record(Timer timer, uint64_t nanoseconds) {
+    ThreadStats* stats = threadStats();
+    bump(stats->counts[timer], 1);
+    bump(stats->sums[timer], nanoseconds);
+    bump(stats->buckets[timer][bucketOf(nanoseconds)], 1);
+    if (nanoseconds > stats->maxima[timer].load(std::memory_order_relaxed)) {
+        stats->maxima[timer].store(nanoseconds, std::memory_order_relaxed);
+    }
+}
+
+std::string WadStats::toJson() {
+    // large, so the merged copy lives on the heap
+    std::unique_ptr<ThreadStats> total(new ThreadStats());
+    {
+        std::lock_guard<std::mutex> lock(registryLock);
+        fold(*total, retired);
+        for (ThreadStats* stats : registry) {
+            fold(*total, *stats);
+        }
+    }
+    uint64_t counters[CounterCount] = {};
+    uint64_t counts[TimerCount] = {};
+    uint64_t sums[TimerCount] = {};
+    uint64_t maxima[TimerCount] = {};
+    std::vector<uint64_t> buckets(TimerCount * bucketCount, 0);
+    for (size_t i = 0; i < CounterCount; ++i) {
+        counters[i] = total->counters[i].load(std::memory_order_relaxed);
+    }
+    for (size_t t = 0; t < TimerCount; ++t) {
+        counts[t] = total->counts[t].load(std::memory_order_relaxed);
+        sums[t] = total->sums[t].load(std::memory_order_relaxed);
+        maxima[t] = total->maxima[t].load(std::memory_order_relaxed);
+        for (size_t b = 0; b < bucketCount; ++b) {
+            buckets[t * bucketCount + b] = total->buckets[t][b].load(std::memory_order_relaxed);
+        }
+    }
+
+    std::ostringstream json;
+    json << "{\"counters\":{";
+    for (size_t i = 0; i < CounterCount; ++i) {
+        json << (i ? "," : "") << "\"" << counterNames[i] << "\":" << counters[i];
+    }
+    json << "},\"latency_ns\":{";
+    bool first = true;
+    for (size_t t = 0; t < TimerCount; ++t) {
+        if (counts[t] == 0) {
+            continue;
+        }
+        json << (first ? "" : ",") << "\"" << timerNames[t] << "\":{\"count\":" << counts[t] << ",\"mean\":" << sums[t] / counts[t] << ",\"max\":" << maxima[t];
+        const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+        const char* quantileNames[] = {"p50", "p90", "p99", "p999"};
+        for (size_t q = 0; q < 4; ++q) {
+            uint64_t rank = static_cast<uint64_t>(quantiles[q] * counts[t]);
+            uint64_t seen = 0;
+            size_t b = 0;
+            for (; b < bucketCount; ++b) {
+                seen += buckets[t * bucketCount + b];
+                if (seen > rank) {
+                    break;
+                }
+            }
+            json << ",\"" << quantileNames[q] << "\":" << std::min(bucketValue(std::min(b, bucketCount - 1)), maxima[t]);
+        }
+        json << "}";
+        first = false;
+    }
+    json << "}}\n";
+    return json.str();
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// low overhead instrumentation: every thread bumps its own counters and log-linear latency
+// histograms without locking, the blocks are only merged when a snapshot is requested
+class WadStats {
+    public:
+        enum Counter {
+            BytesRead,
+            BytesWritten,
+            Lookups,
+            DescriptorRewrites,
+            DirectoryRelocations,
+            BytesDeduplicated,
+            BytesReused,
+            DescriptorsRefreshed,
+            ImagesConverted,
+            CounterCount
+        };
+        enum Timer {
+            // wadfs callbacks
+            Getattr,
+            Readdir,
+            Read,
+            Write,
+            Mknod,
+            Mkdir,
+            Unlink,
+            Rmdir,
+            Rename,
+            Truncate,
+            Getxattr,
+            Listxattr,
+            Readlink,
+            Fsync,
+            // libWad internals
+            Lookup,
+            GetContents,
+            GetDirectory,
+            CreateFile,
+            CreateDirectory,
+            WriteToFile,
+            RemoveFile,
+            RemoveDirectory,
+            RenamePath,
+            TruncateFile,
+            FindLumps,
+            Refresh,
+            GetImage,
+            TimerCount
+        };
+
+        static void add(Counter counter, uint64_t amount = 1);
+        static void record(Timer timer, uint64_t nanoseconds);
+        static std::string toJson();
+};
+
+// records the lifetime of the enclosing scope under one timer
+class WadStatsTimer {
+    WadStats::Timer timer;
+    std::chrono::steady_clock::time_point start;
+
+    public:
+        WadStatsTimer(WadStats::Timer timer) : timer(timer), start(std::chrono::steady_clock::now()) {}
+        ~WadStatsTimer() {
+            WadStats::record(timer, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+};
@@ -0,0 +1,110 @@
+#include "WadTrace.h"
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+struct TraceEvent {
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+};
+
+// oldest events are overwritten once a thread's buffer is full
+struct TraceBuffer {
+    std::mutex lock;
+    std::vector<TraceEvent> events;
+    size_t next = 0;
+    bool wrapped = false;
+    long tid;
+};
+
+std::atomic<bool> WadTrace::active(false);
+static size_t capacity = 1 << 16;
+static std::mutex registryLock;
+static std::vector<TraceBuffer*> registry;
+// buffers of exited threads, still in the registry so a dump shows their events until another
+// thread takes them over
+static std::vector<TraceBuffer*> spare;
+
+struct TraceSlot {
+    TraceBuffer* buffer = nullptr;
+
+    ~TraceSlot() {
+        if (!buffer) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(registryLock);
+        spare.push_back(buffer);
+        buffer = nullptr;
+    }
+};
+
+static TraceBuffer* threadBuffer() {
+    thread_local TraceSlot slot;
+    if (!slot.buffer) {
+        std::lock_guard<std::mutex> lock(registryLock);
+        if (spare.empty()) {
+            slot.buffer = new TraceBuffer();
+            registry.push_back(slot.buffer);
+        } else {
+            slot.buffer = spare.back();
+            spare.pop_back();
+        }
+        std::lock_guard<std::mutex> events(slot.buffer->lock);
+        slot.buffer->events.resize(capacity);
+        slot.buffer->next = 0;
+        slot.buffer->wrapped = false;
+        slot.buffer->tid = syscall(SYS_gettid);
+    }
+    return slot.buffer;
+}
+
+void WadTrace::enable(size_t eventsPerThread) {
+    capacity = std::max<size_t>(eventsPerThread, 1);
+    active.store(true, std::memory_order_relaxed);
+}
+
+uint64_t WadTrace::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void WadTrace::record(const char* name, uint64_t startNs, uint64_t durationNs) {
+    TraceBuffer* buffer = threadBuffer();
+    // only contended while a dump is running
+    std::lock_guard<std::mutex> lock(buffer->lock);
+    buffer->events[buffer->next] = TraceEvent{name, startNs, durationNs};
+    if (++buffer->next == buffer->events.size()) {
+        buffer->next = 0;
+        buffer->wrapped = true;
+    }
+}
+
+bool WadTrace::dump(const std::string &path) {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    long pid = getpid();
+    out << std::fixed;
+    out.precision(3);
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    std::lock_guard<std::mutex> registryGuard(registryLock);
+    for (TraceBuffer* buffer : registry) {
+        std::lock_guard<std::mutex> lock(buffer->lock);
+        out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << buffer->tid << ",\"args\":{\"name\":\"" << buffer->tid << "\"}}";
+        first = false;
+        size_t count = buffer->wrapped ? buffer->events.size() : buffer->next;
+        size_t begin = buffer->wrapped ? buffer->next : 0;
+        for (size_t i = 0; i < count; ++i) {
+            const TraceEvent& event = buffer->events[(begin + i) % buffer->events.size()];
+            // chrome trace timestamps are microseconds
+            out << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << buffer->tid << ",\"ts\":" << event.start / 1000.0 << ",\"dur\":" << event.duration / 1000.0 << "}";
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    return static_cast<bool>(out);
+}
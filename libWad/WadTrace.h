@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// optional span tracing: scopes are recorded into per-thread ring buffers and written out in
+// chrome trace json (chrome://tracing, ui.perfetto.dev) on request
+// when tracing is off a scope costs one relaxed load and a branch
+class WadTrace {
+    static std::atomic<bool> active;
+
+    public:
+        static void enable(size_t eventsPerThread = 1 << 16);
+        static inline bool enabled() {
+            return active.load(std::memory_order_relaxed);
+        }
+        static void record(const char* name, uint64_t startNs, uint64_t durationNs);
+        static uint64_t now();
+        static bool dump(const std::string &path);
+};
+
+// name must outlive the trace, string literals only
+class WadTraceScope {
+    const char* name;
+    uint64_t start;
+
+    public:
+        WadTraceScope(const char* name) : name(name), start(WadTrace::enabled() ? WadTrace::now() : 0) {}
+        ~WadTraceScope() {
+            if (start) {
+                WadTrace::record(name, start, WadTrace::now() - start);
+            }
+        }
+};
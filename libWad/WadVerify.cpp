@@ -0,0 +1,349 @@
+#include "WadVerify.h"
+#include <atomic>
+#include <map>
+#include <thread>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// a distinct stored extent, lumps pointing at the same bytes share one
+struct VerifyExtent {
+    uint64_t offset;
+    uint64_t stored;
+    std::string path;
+    uint32_t crc = 0;
+    // archive modification time (ns) of the run that computed crc
+    uint64_t hashedAt = 0;
+    bool hashed = false;
+    bool readFailed = false;
+};
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32cHardware(uint32_t crc, const char *data, size_t size) {
+    uint64_t state = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        state = _mm_crc32_u64(state, word);
+    }
+    for (; size > 0; ++data, --size) {
+        state = _mm_crc32_u8(static_cast<uint32_t>(state), *data);
+    }
+    return static_cast<uint32_t>(state);
+}
+#endif
+
+static uint32_t crc32cSoftware(uint32_t crc, const char *data, size_t size) {
+    static uint32_t table[256];
+    static bool built = [] {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = (value >> 1) ^ (value & 1 ? 0x82F63B78 : 0);
+            }
+            table[i] = value;
+        }
+        return true;
+    }();
+    (void)built;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+uint32_t WadVerify::crc32c(uint32_t crc, const char *data, size_t size) {
+#if defined(__x86_64__)
+    static bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) {
+        return ~crc32cHardware(~crc, data, size);
+    }
+#endif
+    return ~crc32cSoftware(~crc, data, size);
+}
+
+// a checksum from the sidecar, keyed by extent and tagged with the lump that named it
+struct KnownExtent {
+    uint32_t crc;
+    uint64_t hashedAt;
+    std::string path;
+};
+
+// sidecar: "wadcrc 3" then one "offset stored crc hashedAt path" line per extent, version 2 has no
+// hashedAt and version 1 no path either, missing ones load as 0 and empty so nothing old is trusted
+static bool loadSidecar(const std::string &path, std::map<std::pair<uint64_t, uint64_t>, KnownExtent> *crcs) {
+    std::ifstream in(path);
+    std::string tag;
+    int version;
+    if (!(in >> tag >> version) || tag != "wadcrc" || version < 1 || version > 3) {
+        return false;
+    }
+    uint64_t offset, stored;
+    uint32_t crc;
+    while (in >> offset >> stored >> std::hex >> crc >> std::dec) {
+        uint64_t hashedAt = 0;
+        std::string lumpPath;
+        if (version == 3) {
+            in >> hashedAt;
+        }
+        if (version >= 2) {
+            in >> std::ws;
+            std::getline(in, lumpPath);
+        }
+        (*crcs)[{offset, stored}] = KnownExtent{crc, hashedAt, lumpPath};
+    }
+    return true;
+}
+
+static bool saveSidecar(const std::string &path, const std::vector<VerifyExtent> &extents) {
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream out(temp);
+        out << "wadcrc 3\n";
+        for (const VerifyExtent& extent : extents) {
+            if (extent.hashed) {
+                out << extent.offset << " " << extent.stored << " " << std::hex << extent.crc << std::dec << " " << extent.hashedAt << " " << extent.path << "\n";
+            }
+        }
+        if (!out) {
+            return false;
+        }
+    }
+    return rename(temp.c_str(), path.c_str()) == 0;
+}
+
+bool WadVerify::verify(const std::string &path, const WadVerifyOptions &options, WadVerifyReport *report) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        report->problems.push_back(path + ": cannot open");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    uint64_t fileSize = st.st_size;
+    uint64_t modifiedAt = uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+    // header
+    char header[WAD_EXTENDED_HEADER_SIZE] = {0};
+    std::string magic;
+    if (pread(fd, header, WAD_EXTENDED_HEADER_SIZE, 0) >= WAD_CLASSIC_HEADER_SIZE) {
+        magic = std::string(header, 4);
+    }
+    bool extended = magic == WAD_EXTENDED_MAGIC;
+    if (!extended && magic != "IWAD" && magic != "PWAD") {
+        report->problems.push_back("header: not a wad");
+        close(fd);
+        return false;
+    }
+    uint64_t headerSize = extended ? WAD_EXTENDED_HEADER_SIZE : WAD_CLASSIC_HEADER_SIZE;
+    uint64_t descriptorSize = extended ? 24 : 16;
+    uint64_t count = 0, directoryOffset = 0;
+    bool compressed = false;
+    if (extended) {
+        uint32_t flags;
+        std::memcpy(&flags, header + 4, 4);
+        compressed = flags & WAD_FLAG_COMPRESSED;
+        std::memcpy(&count, header + 8, 8);
+        std::memcpy(&directoryOffset, header + 16, 8);
+    } else {
+        uint32_t classicCount, classicOffset;
+        std::memcpy(&classicCount, header + 4, 4);
+        std::memcpy(&classicOffset, header + 8, 4);
+        count = classicCount;
+        directoryOffset = classicOffset;
+    }
+    if (directoryOffset < headerSize || directoryOffset > fileSize || count > (fileSize - directoryOffset) / descriptorSize) {
+        report->problems.push_back("header: descriptor table outside the file");
+        close(fd);
+        return false;
+    }
+    uint64_t directoryEnd = directoryOffset + count * descriptorSize;
+    std::vector<char> table(count * descriptorSize);
+    if (pread(fd, table.data(), table.size(), directoryOffset) != static_cast<ssize_t>(table.size())) {
+        report->problems.push_back("header: descriptor table unreadable");
+        close(fd);
+        return false;
+    }
+
+    // structure: walk the table the way the loader does, checking what the loader lets slide
+    std::vector<VerifyExtent> extents;
+    std::vector<std::string> namespaces;
+    std::string map;
+    int mapRank = -1;
+    for (uint64_t i = 0; i < count; ++i) {
+        const char* descriptor = table.data() + i * descriptorSize;
+        uint64_t offset = 0, length = 0;
+        if (extended) {
+            std::memcpy(&offset, descriptor, 8);
+            std::memcpy(&length, descriptor + 8, 8);
+        } else {
+            uint32_t classicOffset, classicLength;
+            std::memcpy(&classicOffset, descriptor, 4);
+            std::memcpy(&classicLength, descriptor + 4, 4);
+            offset = classicOffset;
+            length = classicLength;
+        }
+        std::string name(descriptor + descriptorSize - 8, strnlen(descriptor + descriptorSize - 8, 8));
+        // tombstone left by a remove
+        if (name.empty()) {
+            continue;
+        }
+        std::string where = "descriptor " + std::to_string(i) + " (" + name + ")";
+        WadNameKind kind = WadNames::classify(name);
+        if (!map.empty()) {
+            mapRank = kind == WadNameKind::Lump ? WadNames::nextMapRank(mapRank, name) : -1;
+            if (mapRank < 0) {
+                map.clear();
+            }
+        }
+        if (kind == WadNameKind::NamespaceStart) {
+            namespaces.emplace_back(WadNames::pathName(name));
+            continue;
+        }
+        if (kind == WadNameKind::NamespaceEnd) {
+            if (namespaces.empty() || namespaces.back() != WadNames::pathName(name)) {
+                report->problems.push_back(where + ": _END without a matching _START");
+            } else {
+                namespaces.pop_back();
+            }
+            continue;
+        }
+        if (kind == WadNameKind::MapMarker) {
+            map = name;
+            mapRank = -1;
+            continue;
+        }
+        std::string lumpPath;
+        for (const std::string& space : namespaces) {
+            lumpPath += "/" + space;
+        }
+        if (!map.empty()) {
+            lumpPath += "/" + map;
+        }
+        lumpPath += "/" + name;
+        report->lumps++;
+        if (length == 0) {
+            continue;
+        }
+        uint64_t stored = length;
+        if (compressed) {
+            // the stored size is the last block end past the block index
+            uint64_t lastEnd = 0;
+            uint64_t indexSize = WadCodec::indexSize(length);
+            if (offset > fileSize || indexSize > fileSize - offset || pread(fd, &lastEnd, 8, offset + indexSize - 8) != 8) {
+                report->problems.push_back(lumpPath + ": block index outside the file");
+                continue;
+            }
+            stored = indexSize + lastEnd;
+        }
+        if (offset < headerSize || offset > fileSize || stored > fileSize - offset) {
+            report->problems.push_back(lumpPath + ": extent outside the file");
+            continue;
+        }
+        if (offset < directoryEnd && offset + stored > directoryOffset) {
+            report->problems.push_back(lumpPath + ": extent overlaps the descriptor table");
+        }
+        extents.push_back(VerifyExtent{offset, stored, lumpPath});
+    }
+    for (const std::string& space : namespaces) {
+        report->problems.push_back(space + "_START: never closed");
+    }
+
+    // overlaps: identical extents are shared on purpose, anything else crossing is damage
+    // stable, so a shared extent keeps the path of its first lump in table order
+    std::stable_sort(extents.begin(), extents.end(), [](const VerifyExtent &a, const VerifyExtent &b) {
+        return a.offset != b.offset ? a.offset < b.offset : a.stored < b.stored;
+    });
+    extents.erase(std::unique(extents.begin(), extents.end(), [](const VerifyExtent &a, const VerifyExtent &b) {
+        return a.offset == b.offset && a.stored == b.stored;
+    }), extents.end());
+    size_t furthest = 0;
+    for (size_t i = 1; i < extents.size(); ++i) {
+        const VerifyExtent& previous = extents[furthest];
+        if (extents[i].offset < previous.offset + previous.stored) {
+            report->problems.push_back(extents[i].path + ": extent overlaps " + previous.path);
+        }
+        if (extents[i].offset + extents[i].stored > previous.offset + previous.stored) {
+            furthest = i;
+        }
+    }
+
+    // checksums
+    std::map<std::pair<uint64_t, uint64_t>, KnownExtent> known;
+    bool haveSidecar = !options.sidecar.empty() && loadSidecar(options.sidecar, &known);
+    std::vector<size_t> jobs;
+    for (size_t i = 0; i < extents.size(); ++i) {
+        auto it = known.find({extents[i].offset, extents[i].stored});
+        if (options.quick && it != known.end() && it->second.path == extents[i].path) {
+            extents[i].crc = it->second.crc;
+            extents[i].hashedAt = it->second.hashedAt;
+            extents[i].hashed = true;
+            report->lumpsSkipped++;
+        } else {
+            jobs.push_back(i);
+        }
+    }
+    unsigned threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    std::atomic<size_t> next(0);
+    std::atomic<uint64_t> hashedBytes(0);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < std::min<size_t>(threads, jobs.size()); ++t) {
+        workers.emplace_back([&]() {
+            std::vector<char> chunk(1 << 20);
+            for (size_t j = next++; j < jobs.size(); j = next++) {
+                VerifyExtent& extent = extents[jobs[j]];
+                uint32_t crc = 0;
+                uint64_t done = 0;
+                while (done < extent.stored) {
+                    size_t n = std::min<uint64_t>(chunk.size(), extent.stored - done);
+                    if (pread(fd, chunk.data(), n, extent.offset + done) != static_cast<ssize_t>(n)) {
+                        extent.readFailed = true;
+                        break;
+                    }
+                    crc = crc32c(crc, chunk.data(), n);
+                    done += n;
+                }
+                extent.crc = crc;
+                extent.hashedAt = modifiedAt;
+                extent.hashed = !extent.readFailed;
+                hashedBytes += done;
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    close(fd);
+    report->bytesHashed += hashedBytes;
+
+    for (size_t j : jobs) {
+        VerifyExtent& extent = extents[j];
+        if (extent.readFailed) {
+            report->problems.push_back(extent.path + ": read failed");
+            continue;
+        }
+        auto it = known.find({extent.offset, extent.stored});
+        // an extent freed by a remove and handed to another lump is new data, not damage
+        if (it == known.end() || (!it->second.path.empty() && it->second.path != extent.path)) {
+            report->lumpsAdded += haveSidecar ? 1 : 0;
+        } else if (it->second.crc != extent.crc && it->second.hashedAt < modifiedAt) {
+            // the archive was written since this crc was taken, a lump truncated and written again
+            // in a later session can land on the extent it had before
+            report->lumpsRewritten++;
+        } else if (it->second.crc != extent.crc) {
+            std::ostringstream line;
+            line << extent.path << ": crc32c " << std::hex << extent.crc << ", sidecar has " << it->second.crc;
+            report->problems.push_back(line.str());
+            // a later update keeps the good checksum so the damage stays visible
+            extent.crc = it->second.crc;
+            extent.hashedAt = it->second.hashedAt;
+        }
+    }
+    if (options.updateSidecar && !options.sidecar.empty() && !saveSidecar(options.sidecar, extents)) {
+        report->problems.push_back(options.sidecar + ": cannot write sidecar");
+    }
+    return report->problems.empty();
+}
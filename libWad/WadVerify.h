@@ -0,0 +1,38 @@
+#pragma once
+
+#include "Wad.h"
+
+struct WadVerifyOptions {
+    // worker threads for checksumming, 0 uses every core
+    unsigned threads = 0;
+    // optional checksum file, lumps found in it are compared against the stored crc
+    std::string sidecar;
+    // rewrite the sidecar with the checksums of this run
+    bool updateSidecar = false;
+    // trust extents already in the sidecar under the same lump path and only hash the rest, lump
+    // data is never rewritten in place and a write never reuses space its own path left in the same
+    // session (see Wad::vacated), so new bytes show up under an extent the sidecar does not have
+    bool quick = false;
+};
+
+struct WadVerifyReport {
+    // one human readable line per structural or checksum problem
+    std::vector<std::string> problems;
+    uint64_t lumps = 0;
+    uint64_t bytesHashed = 0;
+    uint64_t lumpsSkipped = 0;
+    uint64_t lumpsAdded = 0;
+    // crc changed on an extent the archive was written to after the sidecar took it, counted
+    // instead of reported since the lump may have been written again there in an earlier session
+    uint64_t lumpsRewritten = 0;
+};
+
+// integrity checks that read the archive directly instead of trusting the lenient loader:
+// descriptor bounds, overlapping extents and balanced _START/_END, then a crc32c of every lump's
+// stored bytes computed in parallel, with sse4.2 when the cpu has it
+// lumps that share an extent exactly (deduplicated writes) are fine and hashed once
+class WadVerify {
+    public:
+        static uint32_t crc32c(uint32_t crc, const char *data, size_t size);
+        static bool verify(const std::string &path, const WadVerifyOptions &options, WadVerifyReport *report);
+};
@@ -0,0 +1,70 @@
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <new>
+#include <unistd.h>
+#include "../bench/synthetic.h"
+#include "../libWad/WadOverlay.h"
+
+// every heap allocation in the process is counted, as in wadbench
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+// the string_view lookup and read paths of Wad and WadOverlay must not touch the heap
+int main() {
+    std::string path = (std::filesystem::temp_directory_path() / ("allocations-" + std::to_string(getpid()) + ".wad")).string();
+    SyntheticOptions options;
+    options.lumps = 1000;
+    options.maxSize = 4096;
+    std::vector<std::string> lumps;
+    std::vector<std::string> namespaces;
+    if (!generateSyntheticWad(path, options, &lumps, &namespaces)) {
+        fprintf(stderr, "allocations: cannot generate %s\n", path.c_str());
+        return 1;
+    }
+    Wad* wad = Wad::loadWad(path);
+    WadOverlay* overlay = WadOverlay::loadOverlay({path});
+    std::filesystem::remove(path);
+    if (!wad || !overlay) {
+        fprintf(stderr, "allocations: cannot load %s\n", path.c_str());
+        return 1;
+    }
+
+    char buffer[64];
+    // first calls on a thread register its stats slot
+    wad->getSize(std::string_view(lumps.front()));
+    size_t before = allocations.load();
+    for (size_t i = 0; i < lumps.size(); ++i) {
+        std::string_view lump = lumps[i];
+        std::string_view dir = namespaces[i % namespaces.size()];
+        if (!wad->getNode(lump) || !wad->isContent(lump) || !wad->isDirectory(dir) || wad->getSize(lump) < 0 || wad->getContents(lump, buffer, sizeof(buffer)) < 0 ||
+            !overlay->isContent(lump) || !overlay->isDirectory(dir) || overlay->getSize(lump) < 0 || overlay->getContents(lump, buffer, sizeof(buffer)) < 0) {
+            fprintf(stderr, "allocations: lookup of %s failed\n", lumps[i].c_str());
+            return 1;
+        }
+    }
+    size_t made = allocations.load() - before;
+    delete overlay;
+    delete wad;
+    if (made) {
+        fprintf(stderr, "allocations: string_view lookups allocated %zu times over %zu lumps\n", made, lumps.size());
+        return 1;
+    }
+    printf("allocations: ok, %zu lumps\n", lumps.size());
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <unistd.h>
+#include "../libWad/WadBuilder.h"
+#include "../libWad/WadVerify.h"
+
+static int fail(const std::string &path, const std::string &message) {
+    fprintf(stderr, "quickverify: %s\n", message.c_str());
+    std::filesystem::remove(path);
+    std::filesystem::remove(path + ".crc");
+    return 1;
+}
+
+// one session of edits on the archive, false when an edit failed
+static bool edit(const std::string &path, const std::function<bool(Wad*)> &edits) {
+    Wad* wad = Wad::loadWad(path);
+    bool ok = wad && edits(wad);
+    delete wad;
+    return ok;
+}
+
+static uint64_t offsetOf(const std::string &path, const std::string &lump) {
+    Wad* wad = Wad::loadWad(path);
+    WadExtent extent;
+    bool found = wad && wad->getExtent(wad->getNode(lump), &extent);
+    delete wad;
+    return found ? extent.offset : 0;
+}
+
+// after each edit a quick run must hash the 5 new bytes instead of trusting an old checksum, and a
+// full run against what it wrote must pass
+static std::string quickThenFull(const std::string &path, WadVerifyOptions options) {
+    options.quick = true;
+    options.updateSidecar = true;
+    WadVerifyReport quick;
+    if (!WadVerify::verify(path, options, &quick)) {
+        return "quick verify failed: " + (quick.problems.empty() ? std::string() : quick.problems.front());
+    }
+    if (quick.bytesHashed != 5) {
+        return "quick verify trusted a rewritten extent";
+    }
+    options.quick = false;
+    options.updateSidecar = false;
+    WadVerifyReport full;
+    if (!WadVerify::verify(path, options, &full)) {
+        return "full verify failed: " + (full.problems.empty() ? std::string() : full.problems.front());
+    }
+    return std::string();
+}
+
+int main() {
+    std::string path = (std::filesystem::temp_directory_path() / ("quickverify-" + std::to_string(getpid()) + ".wad")).string();
+    WadBuilder* builder = WadBuilder::create(path);
+    bool built = builder && builder->beginNamespace("F1") && builder->addLump("X", "hello", 5) && builder->addLump("W", nullptr, 0) && builder->endNamespace() && builder->finish();
+    delete builder;
+    if (!built) {
+        return fail(path, "cannot build the archive");
+    }
+
+    WadVerifyOptions options;
+    options.threads = 1;
+    options.sidecar = path + ".crc";
+    options.updateSidecar = true;
+    WadVerifyReport first;
+    if (!WadVerify::verify(path, options, &first)) {
+        return fail(path, "first verify failed");
+    }
+
+    // another lump takes the extent a remove freed
+    uint64_t removed = offsetOf(path, "/F1/X");
+    if (!edit(path, [](Wad* wad) { return wad->removeFile("/F1/X") == 0 && wad->writeToFile("/F1/W", "world", 5) == 5; })) {
+        return fail(path, "cannot remove and write");
+    }
+    if (offsetOf(path, "/F1/W") != removed) {
+        return fail(path, "the write did not reuse the removed extent");
+    }
+    std::string problem = quickThenFull(path, options);
+    if (!problem.empty()) {
+        return fail(path, "reuse by another lump: " + problem);
+    }
+
+    // open(O_TRUNC) and write over fuse: the same lump written again with as many bytes
+    uint64_t before = offsetOf(path, "/F1/W");
+    if (!edit(path, [](Wad* wad) { return wad->truncateFile("/F1/W", 0) == 0 && wad->writeToFile("/F1/W", "again", 5) == 5; })) {
+        return fail(path, "cannot truncate and write");
+    }
+    if (offsetOf(path, "/F1/W") == before) {
+        return fail(path, "a rewritten lump went back to its own extent");
+    }
+    problem = quickThenFull(path, options);
+    if (!problem.empty()) {
+        return fail(path, "truncate and rewrite: " + problem);
+    }
+
+    // removed and created again under the same path
+    if (!edit(path, [](Wad* wad) { return wad->removeFile("/F1/W") == 0 && wad->createFile("/F1/W") && wad->writeToFile("/F1/W", "fresh", 5) == 5; })) {
+        return fail(path, "cannot remove and create");
+    }
+    problem = quickThenFull(path, options);
+    if (!problem.empty()) {
+        return fail(path, "remove and create: " + problem);
+    }
+
+    // across sessions a lump can land where it was when the sidecar was taken, a full run counts
+    // that as rewritten rather than damage
+    uint64_t original = offsetOf(path, "/F1/W");
+    bool moved = edit(path, [](Wad* wad) { return wad->renamePath("/F1/W", "/F1/Y") == 0; }) &&
+                 edit(path, [](Wad* wad) { return wad->removeFile("/F1/Y") == 0 && wad->createFile("/F1/W") && wad->writeToFile("/F1/W", "later", 5) == 5; });
+    if (!moved || offsetOf(path, "/F1/W") != original) {
+        return fail(path, "cannot put the lump back on its old extent");
+    }
+    options.quick = false;
+    options.updateSidecar = false;
+    WadVerifyReport full;
+    if (!WadVerify::verify(path, options, &full) || full.lumpsRewritten != 1) {
+        return fail(path, "a lump written again on its old extent was reported as damage");
+    }
+    std::filesystem::remove(path);
+    std::filesystem::remove(path + ".crc");
+    printf("quickverify: ok\n");
+    return 0;
+}
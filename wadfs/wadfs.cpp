@@ -9,48 +9,426 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include "../libWad/Wad.h"
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <signal.h>
+#include <poll.h>
+#include <set>
+#include <sys/inotify.h>
+#include "../libWad/WadOverlay.h"
+#include "../libWad/WadLibrary.h"
+
+// exactly one of these is set: a single/union mount, or a directory of wads
+struct Mount {
+    std::shared_ptr<WadOverlay> overlay;
+    WadLibrary* library = nullptr;
+    // what was mounted, the layer files or the library directory
+    std::vector<std::string> wadPaths;
+};
+
+// lookups, xattrs, reads, creates and writes hold this shared and run in parallel on libWad's own locks,
+// so imports into different namespaces only meet when they commit to the descriptor table
+// everything else (removes, renames, listings, fsync, refreshes) holds it exclusive
+static std::shared_mutex wadfsLock;
+
+// maps a mount path to the archive serving it and the path inside that archive
+// subPath points into path, so lookups on the read side do not copy it
+// returns nullptr for the library root, which is not inside any archive
+static std::shared_ptr<WadOverlay> resolve(const char* path, std::string_view& subPath) {
+    Mount* mount = (Mount*)fuse_get_context()->private_data;
+    if (mount->overlay) {
+        subPath = path;
+        return mount->overlay;
+    }
+    const char* rest = strchr(path + 1, '/');
+    std::string name = rest ? std::string(path + 1, rest) : std::string(path + 1);
+    subPath = rest ? std::string_view(rest) : std::string_view("/");
+    if (name.empty()) {
+        return nullptr;
+    }
+    return mount->library->acquire(name);
+}
+
+// hidden control directory, reachable by path but never listed
+// /.wadfs/stats is a json snapshot of WadStats taken when the file is opened
+static const char* controlDir = "/.wadfs";
+static const char* statsFile = "/.wadfs/stats";
+
+// the control directory or anything under it, /.wadfsX is an ordinary path
+static bool isControlPath(const char* path) {
+    size_t length = strlen(controlDir);
+    return strncmp(path, controlDir, length) == 0 && (path[length] == '\0' || path[length] == '/');
+}
+
+// set by --images, sprites, patches and flats get a read only NAME.bmp next to them
+static bool imageViews = false;
+
+// virtual query directory inside every archive: /.find/PATTERN lists the lumps whose name matches
+// PATTERN (exact, TROO* or any '*' / '?' glob) as symlinks named by their path with '/' turned into
+// '|', pointing back at the lump, so a search costs one readdir instead of a getattr per node
+static const std::string_view findDir = "/.find";
+
+// splits a path under /.find into the pattern and the entry, both empty for /.find itself
+static bool parseFind(std::string_view subPath, std::string_view& pattern, std::string_view& entry) {
+    if (subPath.substr(0, findDir.size()) != findDir || (subPath.size() > findDir.size() && subPath[findDir.size()] != '/')) {
+        return false;
+    }
+    std::string_view rest = subPath.substr(std::min(subPath.size(), findDir.size() + 1));
+    size_t slash = rest.find('/');
+    pattern = rest.substr(0, slash);
+    entry = slash == std::string_view::npos ? std::string_view() : rest.substr(slash + 1);
+    return true;
+}
+
+// the lump an entry stands for, if it exists and matches the pattern
+static bool findTarget(WadOverlay* wad, std::string_view pattern, std::string_view entry, std::string& lumpPath) {
+    lumpPath = "/" + std::string(entry);
+    std::replace(lumpPath.begin(), lumpPath.end(), '|', '/');
+    return entry.find('/') == std::string_view::npos && wad->isContent(lumpPath) && WadNames::matches(pattern, lumpPath.substr(lumpPath.find_last_of('/') + 1));
+}
+
+// from /.find/PATTERN/entry back up to the archive root, relative so it works wherever the
+// mount or the archive's directory is
+static std::string findLink(const std::string& lumpPath) {
+    return "../.." + lumpPath;
+}
+
+static bool isLibraryRoot(const char* path) {
+    Mount* mount = (Mount*)fuse_get_context()->private_data;
+    return mount->library && strcmp(path, "/") == 0;
+}
 
 static int getattr_callback(const char* path, struct stat* stbuf) {
+    WadStatsTimer timer(WadStats::Getattr);
+    WadTraceScope span("getattr");
     memset(stbuf, 0, sizeof(struct stat));
-    Wad* wad = (Wad*)fuse_get_context()->private_data;
-    if (wad->isContent(path)) {
+    if (strcmp(path, controlDir) == 0) {
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+        return 0;
+    } else if (strcmp(path, statsFile) == 0) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = WadStats::toJson().size();
+        return 0;
+    }
+    std::shared_lock<std::shared_mutex> lock(wadfsLock);
+    if (isLibraryRoot(path)) {
+        stbuf->st_mode = S_IFDIR | 0777;
+        stbuf->st_nlink = 2;
+        return 0;
+    }
+    std::string_view subPath;
+    std::shared_ptr<WadOverlay> wad = resolve(path, subPath);
+    if (!wad) {
+        return -ENOENT;
+    }
+    std::string_view pattern, entry;
+    if (parseFind(subPath, pattern, entry)) {
+        std::string lumpPath;
+        if (entry.empty()) {
+            stbuf->st_mode = S_IFDIR | 0555;
+            stbuf->st_nlink = 2;
+            return 0;
+        } else if (findTarget(wad.get(), pattern, entry, lumpPath)) {
+            stbuf->st_mode = S_IFLNK | 0777;
+            stbuf->st_nlink = 1;
+            stbuf->st_size = findLink(lumpPath).size();
+            return 0;
+        }
+        return -ENOENT;
+    }
+    if (wad->isContent(subPath)) {
         stbuf->st_mode = S_IFREG | 0777;
         stbuf->st_nlink = 1;
-        stbuf->st_size = wad->getSize(path);
+        stbuf->st_size = wad->getSize(subPath);
         return 0;
-    } else if (wad->isDirectory(path)) {
+    } else if (wad->isDirectory(subPath)) {
         stbuf->st_mode = S_IFDIR | 0777;
         stbuf->st_nlink = 2;
         return 0;
+    } else if (imageViews && wad->isImage(subPath)) {
+        off_t size = wad->getImageSize(subPath);
+        if (size >= 0) {
+            stbuf->st_mode = S_IFREG | 0444;
+            stbuf->st_nlink = 1;
+            stbuf->st_size = size;
+            return 0;
+        }
     }
     return -ENOENT;
 }
 
+static int readlink_callback(const char* path, char* buf, size_t size) {
+    WadStatsTimer timer(WadStats::Readlink);
+    WadTraceScope span("readlink");
+    std::shared_lock<std::shared_mutex> lock(wadfsLock);
+    std::string_view subPath, pattern, entry;
+    std::shared_ptr<WadOverlay> wad = resolve(path, subPath);
+    std::string lumpPath;
+    if (!wad || !parseFind(subPath, pattern, entry) || entry.empty() || !findTarget(wad.get(), pattern, entry, lumpPath)) {
+        return -ENOENT;
+    }
+    std::string target = findLink(lumpPath);
+    if (size == 0) {
+        return -EINVAL;
+    }
+    size_t n = std::min(size - 1, target.size());
+    memcpy(buf, target.data(), n);
+    buf[n] = '\0';
+    return 0;
+}
+
 static int mknod_callback(const char* path, mode_t mode, dev_t dev) {
-    Wad* wad = (Wad*)fuse_get_context()->private_data;
-    wad->createFile(path);
-    if (!wad->isContent(path)) {
+    WadStatsTimer timer(WadStats::Mknod);
+    WadTraceScope span("mknod");
+    std::shared_lock<std::shared_mutex> lock(wadfsLock);
+    std::string_view subPath;
+    std::shared_ptr<WadOverlay> wad = resolve(path, subPath);
+    if (!wad) {
+        return -EPERM;
+    }
+    if (wad->isReadOnly()) {
+        return -EROFS;
+    }
+    wad->createFile(std::string(subPath));
+    if (!wad->isContent(subPath)) {
         return -ENOENT;
     }
     return 0;
 }
 
 static int mkdir_callback(const char* path, mode_t mode) {
-    Wad* wad = (Wad*)fuse_get_context()->private_data;
-    wad->createDirectory(path);
-    if (!wad->isDirectory(path)) {
+    WadStatsTimer timer(WadStats::Mkdir);
+    WadTraceScope span("mkdir");
+    std::shared_lock<std::shared_mutex> lock(wadfsLock);
+    std::string_view subPath;
+    std::shared_ptr<WadOverlay> wad = resolve(path, subPath);
+    if (!wad) {
+        return -EPERM;
+    }
+    if (wad->isReadOnly()) {
+        return -EROFS;
+    }
+    wad->createDirectory(std::string(subPath));
+    if (!wad->isDirectory(subPath)) {
+        return -ENOENT;
+    }
+    return 0;
+}
+
+static int unlink_callback(const char* path) {
+    WadStatsTimer timer(WadStats::Unlink);
+    WadTraceScope span("unlink");
+    std::unique_lock<std::shared_mutex> lock(wadfsLock);
+    std::string_view subPath;
+    std::shared_ptr<WadOverlay> wad = resolve(path, subPath);
+    if (!wad || !wad->isContent(subPath)) {
+        return -ENOENT;
+    }
+    if (wad->isReadOnly()) {
+        return -EROFS;
+    }
+    // lumps that lower layers or map markers pin in place
+    return wad->removeFile(std::string(subPath)) < 0 ? -EPERM : 0;
+}
+
+static int rmdir_callback(const char* path) {
+    WadStatsTimer timer(WadStats::Rmdir);
+    WadTraceScope span("rmdir");
+    std::unique_lock<std::shared_mutex> lock(wadfsLock);
+    std::string_view subPath;
+    std::shared_ptr<WadOverlay> wad = resolve(path, subPath);
+    if (!wad || !wad->isDirectory(subPath)) {
+        return -ENOENT;
+    }
+    std::vector<std::string> entries;
+    if (wad->getDirectory(subPath, &entries) > 0) {
+        return -ENOTEMPTY;
+    }
+    if (wad->isReadOnly()) {
+        return -EROFS;
+    }
+    return wad->removeDirectory(std::string(subPath)) < 0 ? -EPERM : 0;
+}
+
+static int rename_callback(const char* from, const char* to) {
+    WadStatsTimer timer(WadStats::Rename);
+    WadTraceScope span("rename");
+    std::unique_lock<std::shared_mutex> lock(wadfsLock);
+    std::string_view fromPath, toPath;
+    std::shared_ptr<WadOverlay> wad = resolve(from, fromPath);
+    if (!wad || (!wad->isContent(fromPath) && !wad->isDirectory(fromPath))) {
+        return -ENOENT;
+    }
+    // every archive of a library mount is its own file
+    if (resolve(to, toPath) != wad) {
+        return -EXDEV;
+    }
+    if (wad->isReadOnly()) {
+        return -EROFS;
+    }
+    return wad->renamePath(std::string(fromPath), std::string(toPath)) < 0 ? -EPERM : 0;
+}
+
+static int truncate_callback(const char* path, off_t size) {
+    WadStatsTimer timer(WadStats::Truncate);
+    WadTraceScope span("truncate");
+    std::unique_lock<std::shared_mutex> lock(wadfsLock);
+    std::string_view subPath;
+    std::shared_ptr<WadOverlay> wad = resolve(path, subPath);
+    if (!wad || !wad->isContent(subPath)) {
+        return -ENOENT;
+    }
+    if (size < 0) {
+        return -EINVAL;
+    }
+    if (wad->isReadOnly()) {
+        return -EROFS;
+    }
+    return wad->truncateFile(std::string(subPath), size) < 0 ? -EPERM : 0;
+}
+
+// every lump carries read only attributes locating its bytes in the backing archive, so tools that
+// only want raw data can look a lump up through the mount and then pread or mmap the file directly
+//   user.wad.path        absolute path of the archive serving the lump
+//   user.wad.offset      where the stored bytes start in that file
+//   user.wad.length      lump size
+//   user.wad.stored      bytes stored at offset, differs from length when compressed
+//   user.wad.compressed  1 when the stored bytes are block compressed, see WadCodec.h
+//   user.wad.crc32c      hex crc32c of the stored bytes, computed on first request
+static const char xattrList[] = "user.wad.path\0user.wad.offset\0user.wad.length\0user.wad.stored\0user.wad.compressed\0user.wad.crc32c";
+
+static int getxattr_callback(const char* path, const char* name, char* value, size_t size) {
+    WadStatsTimer timer(WadStats::Getxattr);
+    WadTraceScope span("getxattr");
+    if (isControlPath(path)) {
+        return -ENODATA;
+    }
+    std::shared_lock<std::shared_mutex> lock(wadfsLock);
+    if (isLibraryRoot(path)) {
+        return -ENODATA;
+    }
+    std::string_view subPath;
+    std::shared_ptr<WadOverlay> wad = resolve(path, subPath);
+    if (!wad || (!wad->isContent(subPath) && !wad->isDirectory(subPath))) {
         return -ENOENT;
     }
+    WadExtent extent;
+    if (!wad->getExtent(subPath, &extent)) {
+        return -ENODATA;
+    }
+    std::string text;
+    if (strcmp(name, "user.wad.path") == 0) {
+        text = extent.filePath;
+    } else if (strcmp(name, "user.wad.offset") == 0) {
+        text = std::to_string(extent.offset);
+    } else if (strcmp(name, "user.wad.length") == 0) {
+        text = std::to_string(extent.length);
+    } else if (strcmp(name, "user.wad.stored") == 0) {
+        text = std::to_string(extent.stored);
+    } else if (strcmp(name, "user.wad.compressed") == 0) {
+        text = extent.compressed ? "1" : "0";
+    } else if (strcmp(name, "user.wad.crc32c") == 0) {
+        uint32_t crc;
+        if (!wad->getChecksum(subPath, crc)) {
+            return -EIO;
+        }
+        char hex[9];
+        snprintf(hex, sizeof(hex), "%08x", crc);
+        text = hex;
+    } else {
+        return -ENODATA;
+    }
+    // a zero size asks how large the value is
+    if (size == 0) {
+        return text.size();
+    }
+    if (size < text.size()) {
+        return -ERANGE;
+    }
+    memcpy(value, text.data(), text.size());
+    return text.size();
+}
+
+static int listxattr_callback(const char* path, char* list, size_t size) {
+    WadStatsTimer timer(WadStats::Listxattr);
+    WadTraceScope span("listxattr");
+    if (isControlPath(path)) {
+        return 0;
+    }
+    std::shared_lock<std::shared_mutex> lock(wadfsLock);
+    if (isLibraryRoot(path)) {
+        return 0;
+    }
+    std::string_view subPath;
+    std::shared_ptr<WadOverlay> wad = resolve(path, subPath);
+    if (!wad || (!wad->isContent(subPath) && !wad->isDirectory(subPath))) {
+        return -ENOENT;
+    }
+    // namespaces have no extent
+    if (!wad->isContent(subPath)) {
+        return 0;
+    }
+    if (size == 0) {
+        return sizeof(xattrList);
+    }
+    if (size < sizeof(xattrList)) {
+        return -ERANGE;
+    }
+    memcpy(list, xattrList, sizeof(xattrList));
+    return sizeof(xattrList);
+}
+
+static int open_callback(const char* path, struct fuse_file_info* fi) {
+    if (strcmp(path, statsFile) == 0) {
+        // snapshot once so a reader sees one consistent document across reads
+        fi->fh = (uint64_t)new std::string(WadStats::toJson());
+        fi->direct_io = 1;
+    }
     return 0;
 }
 
+static int release_callback(const char* path, struct fuse_file_info* fi) {
+    if (strcmp(path, statsFile) == 0) {
+        delete (std::string*)fi->fh;
+    }
+    return 0;
+}
+
+// with --mmap this is the commit point, the pages written since the last one are msync'd
+static int fsync_callback(const char* path, int datasync, struct fuse_file_info* fi) {
+    WadStatsTimer timer(WadStats::Fsync);
+    std::unique_lock<std::shared_mutex> lock(wadfsLock);
+    std::string_view subPath;
+    std::shared_ptr<WadOverlay> wad = resolve(path, subPath);
+    return !wad || wad->flush() == 0 ? 0 : -EIO;
+}
+
 static int read_callback(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
-    Wad* wad = (Wad*)fuse_get_context()->private_data;
-    if (!wad->isContent(path)) {
+    WadStatsTimer timer(WadStats::Read);
+    WadTraceScope span("read");
+    if (fi && strcmp(path, statsFile) == 0) {
+        std::string* snapshot = (std::string*)fi->fh;
+        if (offset >= (off_t)snapshot->size()) {
+            return 0;
+        }
+        size_t n = std::min(size, snapshot->size() - offset);
+        memcpy(buf, snapshot->data() + offset, n);
+        return n;
+    }
+    std::shared_lock<std::shared_mutex> lock(wadfsLock);
+    std::string_view subPath;
+    std::shared_ptr<WadOverlay> wad = resolve(path, subPath);
+    if (wad && imageViews && !wad->isContent(subPath) && wad->isImage(subPath)) {
+        ssize_t bytesRead = wad->getImage(subPath, buf, size, offset);
+        return bytesRead < 0 ? -EIO : bytesRead;
+    }
+    if (!wad || !wad->isContent(subPath)) {
         return -ENOENT;
     }
-    int bytesRead = wad->getContents(path, buf, size, offset);
+    ssize_t bytesRead = wad->getContents(subPath, buf, size, offset);
     if (bytesRead < 0) {
         return -EIO;
     }
@@ -58,58 +436,375 @@ static int read_callback(const char* path, char* buf, size_t size, off_t offset,
 }
 
 static int write_callback(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
-    Wad* wad = (Wad*)fuse_get_context()->private_data;
-    if (!wad->isContent(path)) {
+    WadStatsTimer timer(WadStats::Write);
+    WadTraceScope span("write");
+    std::shared_lock<std::shared_mutex> lock(wadfsLock);
+    std::string_view subPath;
+    std::shared_ptr<WadOverlay> wad = resolve(path, subPath);
+    if (wad && imageViews && !wad->isContent(subPath) && wad->isImage(subPath)) {
+        return -EACCES;
+    }
+    if (!wad || !wad->isContent(subPath)) {
         return -ENOENT;
     }
-    int bytesWritten = wad->writeToFile(path, buf, size, offset);
+    if (wad->isReadOnly()) {
+        return -EROFS;
+    }
+    ssize_t bytesWritten = wad->writeToFile(std::string(subPath), buf, size, offset);
     if (bytesWritten < 0) {
         return -EIO;
     }
     return bytesWritten;
 }
 
+// directory offsets follow the fuse protocol: "." is 1, ".." is 2 and child i is i + 3, the kernel
+// hands back the last offset it accepted so a large directory resumes instead of starting over
+// the high level api only passes the type bits of st on, sizes and modes still come from getattr
+static bool fillEntry(void* buf, fuse_fill_dir_t filler, const char* name, bool isFile, off_t next) {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = isFile ? S_IFREG : S_IFDIR;
+    return filler(buf, name, &st, next) == 0;
+}
+
+static bool fillDots(void* buf, fuse_fill_dir_t filler, off_t offset) {
+    if (offset < 1 && !fillEntry(buf, filler, ".", false, 1)) {
+        return false;
+    }
+    return offset >= 2 || fillEntry(buf, filler, "..", false, 2);
+}
+
 static int readdir_callback(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
-    Wad* wad = (Wad*)fuse_get_context()->private_data;
-    if (!wad->isDirectory(path)) {
+    WadStatsTimer timer(WadStats::Readdir);
+    WadTraceScope span("readdir");
+    if (strcmp(path, controlDir) == 0) {
+        if (fillDots(buf, filler, offset) && offset < 3) {
+            fillEntry(buf, filler, "stats", true, 3);
+        }
+        return 0;
+    }
+    // listings lock themselves, a readdir only has to keep the mounts in place
+    std::shared_lock<std::shared_mutex> lock(wadfsLock);
+    if (isLibraryRoot(path)) {
+        // the library root is small and rebuilt from the directory scan, so it is not cached
+        std::vector<std::string> entries;
+        Mount* mount = (Mount*)fuse_get_context()->private_data;
+        if (mount->library->getDirectory(&entries) < 0) {
+            return -EIO;
+        }
+        if (!fillDots(buf, filler, offset)) {
+            return 0;
+        }
+        for (size_t i = std::max<off_t>(offset - 2, 0); i < entries.size(); ++i) {
+            if (!fillEntry(buf, filler, entries[i].c_str(), false, i + 3)) {
+                break;
+            }
+        }
+        return 0;
+    }
+    std::string_view subPath;
+    std::shared_ptr<WadOverlay> wad = resolve(path, subPath);
+    std::string_view pattern, entry;
+    if (wad && parseFind(subPath, pattern, entry)) {
+        if (!entry.empty()) {
+            return -ENOTDIR;
+        }
+        if (!fillDots(buf, filler, offset)) {
+            return 0;
+        }
+        // results are recomputed on every call, offsets index into them like a listing
+        std::vector<std::string_view> matches;
+        if (!pattern.empty()) {
+            wad->findLumps(pattern, &matches);
+        }
+        for (size_t i = std::max<off_t>(offset - 2, 0); i < matches.size(); ++i) {
+            std::string name(matches[i].substr(1));
+            std::replace(name.begin(), name.end(), '/', '|');
+            struct stat st;
+            memset(&st, 0, sizeof(st));
+            st.st_mode = S_IFLNK | 0777;
+            if (filler(buf, name.c_str(), &st, i + 3) != 0) {
+                break;
+            }
+        }
+        return 0;
+    }
+    if (!wad || !wad->isDirectory(subPath)) {
         return -ENOENT;
     }
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    std::vector<std::string> entries;
-    wad->getDirectory(path, &entries);
-    for (const std::string& entry : entries) {
-        filler(buf, entry.c_str(), NULL, 0);
+    if (!fillDots(buf, filler, offset)) {
+        return 0;
+    }
+    if (!imageViews || !WadImages::isGraphic(std::string(subPath) + "/")) {
+        wad->readDirectory(subPath, std::max<off_t>(offset - 2, 0), [&](const char* name, bool isFile, size_t next) {
+            return fillEntry(buf, filler, name, isFile, next + 2);
+        });
+        return 0;
     }
+    // every lump is followed by its view, so child i takes offsets 2i + 3 and 2i + 4
+    size_t resume = std::max<off_t>(offset - 2, 0);
+    wad->readDirectory(subPath, resume / 2, [&](const char* name, bool isFile, size_t next) {
+        size_t slot = 2 * (next - 1);
+        if (slot >= resume && !fillEntry(buf, filler, name, isFile, slot + 3)) {
+            return false;
+        }
+        return !isFile || fillEntry(buf, filler, (std::string(name) + ".bmp").c_str(), true, slot + 4);
+    });
     return 0;
 }
 
+// set by --trace=file, spans are written there on SIGUSR1 and on unmount
+static std::string tracePath;
+
+// another program finishing a write to a backing wad (closing it, or renaming a new copy over it)
+// refreshes that archive's index in place, so appended lumps and rewritten tables show up without
+// a remount, see WadOverlay::refresh
+// the parent directories are watched so renames are seen, and only close-after-write counts, which
+// wadfs itself never causes since it keeps its descriptor open
+// fuse 2.6 cannot push invalidations from the high level api: open never sets keep_cache, so file
+// pages are dropped on the next open, and attributes age out after attr_timeout (1s by default)
+static void watchArchives(Mount* mount) {
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    std::map<int, std::string> directories;
+    std::vector<std::string> watched = mount->library ? mount->wadPaths : std::vector<std::string>();
+    for (const std::string& wadPath : mount->wadPaths) {
+        if (!mount->library) {
+            watched.push_back(wadPath.substr(0, std::max<size_t>(wadPath.find_last_of('/'), 1)));
+        }
+    }
+    for (const std::string& directory : watched) {
+        int wd = inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd >= 0) {
+            directories[wd] = directory;
+        }
+    }
+    alignas(struct inotify_event) char buffer[64 * 1024];
+    std::set<std::string> changed;
+    while (true) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        // a tool writing several archives in a row is handled in one pass once it goes quiet
+        do {
+            for (char* p = buffer; p < buffer + n;) {
+                struct inotify_event* event = (struct inotify_event*)p;
+                if (event->len > 0 && directories.count(event->wd)) {
+                    changed.insert(directories[event->wd] + "/" + event->name);
+                }
+                p += sizeof(struct inotify_event) + event->len;
+            }
+            struct pollfd quiet = {fd, POLLIN, 0};
+            n = poll(&quiet, 1, 50) > 0 ? read(fd, buffer, sizeof(buffer)) : 0;
+        } while (n > 0);
+
+        std::unique_lock<std::shared_mutex> lock(wadfsLock);
+        if (!mount->overlay && !mount->library) {
+            break;
+        }
+        if (mount->library) {
+            for (const std::string& path : changed) {
+                mount->library->refresh(path.substr(path.find_last_of('/') + 1));
+            }
+        } else {
+            for (const std::string& wadPath : mount->wadPaths) {
+                if (changed.count(wadPath)) {
+                    mount->overlay->refresh();
+                    break;
+                }
+            }
+        }
+        changed.clear();
+    }
+    close(fd);
+}
+
+static void* init_callback(struct fuse_conn_info* conn) {
+    Mount* mount = (Mount*)fuse_get_context()->private_data;
+    std::thread(watchArchives, mount).detach();
+    if (!tracePath.empty()) {
+        // main blocked SIGUSR1 before fuse started its threads, so only this one receives it
+        std::thread([] {
+            sigset_t set;
+            sigemptyset(&set);
+            sigaddset(&set, SIGUSR1);
+            int signal;
+            while (sigwait(&set, &signal) == 0) {
+                WadTrace::dump(tracePath);
+            }
+        }).detach();
+    }
+    return fuse_get_context()->private_data;
+}
+
+static void destroy_callback(void* privateData) {
+    if (!tracePath.empty()) {
+        WadTrace::dump(tracePath);
+    }
+    // closing the archives flushes and trims mapped ones, the watcher stops once it sees them gone
+    Mount* mount = (Mount*)privateData;
+    std::unique_lock<std::shared_mutex> lock(wadfsLock);
+    mount->overlay.reset();
+    delete mount->library;
+    mount->library = nullptr;
+}
+
+// builds the mount for a directory of wads or a stack of wad files, nullptr if nothing could be opened
+static Mount* loadMount(const std::vector<std::string>& wadPaths, size_t indexCacheMiB, size_t maxOpen) {
+    Mount* mount = new Mount();
+    mount->wadPaths = wadPaths;
+    struct stat st;
+    if (wadPaths.size() == 1 && stat(wadPaths[0].c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        mount->library = WadLibrary::loadLibrary(wadPaths[0], indexCacheMiB << 20, maxOpen);
+    } else {
+        mount->overlay.reset(WadOverlay::loadOverlay(wadPaths));
+    }
+    if (!mount->overlay && !mount->library) {
+        delete mount;
+        return nullptr;
+    }
+    return mount;
+}
+
 static struct fuse_operations operations = {
     .getattr = getattr_callback,
+    .readlink = readlink_callback,
     .mknod = mknod_callback,
     .mkdir = mkdir_callback,
+    .unlink = unlink_callback,
+    .rmdir = rmdir_callback,
+    .rename = rename_callback,
+    .truncate = truncate_callback,
+    .open = open_callback,
     .read = read_callback,
     .write = write_callback,
+    .release = release_callback,
+    .fsync = fsync_callback,
+    .getxattr = getxattr_callback,
+    .listxattr = listxattr_callback,
     .readdir = readdir_callback,
+    .init = init_callback,
+    .destroy = destroy_callback,
 };
 
+// the replay harness in bench/ includes this file and drives the callbacks itself
+#ifndef WADFS_NO_MAIN
 int main(int argc, char* argv[]) {
     // from ernesto vid
+    // usage: wadfs [fuse options] base.wad [patch.wad ...] mountpoint
+    // later wads are layered over earlier ones, the last one receives writes
+    //    or: wadfs [fuse options] [--index-cache=MiB] [--max-open=N] wad_directory mountpoint
+    // every .wad in the directory shows up as a subdirectory, loaded on first access
+    // --trace=file [--trace-events=N] records spans, kill -USR1 or unmounting writes them to file
+    // --dedup stores a written lump by reference when identical bytes are already in the archive
+    // --mmap writes through a shared mapping of the writable archive, fsync or unmounting commits
+    // --images[=MiB] adds NAME.bmp views of graphics, converted on first read and cached (64 MiB,
+    //     one cache shared by every archive of a library)
+
+    size_t indexCacheMiB = 256;
+    size_t maxOpen = 64;
+    size_t traceEvents = 1 << 16;
+    bool dedup = false;
+    bool mappedWrites = false;
+    size_t imageCacheMiB = 0;
+    int kept = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--index-cache=", 14) == 0) {
+            indexCacheMiB = strtoull(argv[i] + 14, nullptr, 10);
+        } else if (strncmp(argv[i], "--max-open=", 11) == 0) {
+            maxOpen = strtoull(argv[i] + 11, nullptr, 10);
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            dedup = true;
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            mappedWrites = true;
+        } else if (strcmp(argv[i], "--images") == 0) {
+            imageCacheMiB = 64;
+        } else if (strncmp(argv[i], "--images=", 9) == 0) {
+            imageCacheMiB = std::max<size_t>(strtoull(argv[i] + 9, nullptr, 10), 1);
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            tracePath = argv[i] + 8;
+        } else if (strncmp(argv[i], "--trace-events=", 15) == 0) {
+            traceEvents = strtoull(argv[i] + 15, nullptr, 10);
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
 
     if (argc < 3) {
         std::cout << "Not enough arguments." << std::endl;
         exit(EXIT_SUCCESS);
     }
 
-    std::string wadPath = argv[argc - 2];
+    // wad paths are the non-option arguments right before the mount point
+    int firstWad = argc - 1;
+    while (firstWad - 1 >= 1 && argv[firstWad - 1][0] != '-' && (firstWad - 2 < 1 || strcmp(argv[firstWad - 2], "-o") != 0)) {
+        firstWad--;
+    }
+    if (firstWad == argc - 1) {
+        std::cout << "Not enough arguments." << std::endl;
+        exit(EXIT_SUCCESS);
+    }
 
-    if (wadPath.at(0) != '/') {
-        wadPath = std::string(get_current_dir_name()) + "/" + wadPath;
+    std::vector<std::string> wadPaths;
+    for (int i = firstWad; i < argc - 1; ++i) {
+        std::string wadPath = argv[i];
+        if (wadPath.at(0) != '/') {
+            wadPath = std::string(get_current_dir_name()) + "/" + wadPath;
+        }
+        wadPaths.push_back(wadPath);
     }
-    Wad* myWad = Wad::loadWad(wadPath);
 
-    argv[argc - 2] = argv[argc - 1];
-    argc--;
+    Mount* mount = loadMount(wadPaths, indexCacheMiB, maxOpen);
+    if (!mount) {
+        std::cout << "Could not open " << wadPaths.back() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (dedup) {
+        if (mount->overlay) {
+            mount->overlay->setDeduplication(true);
+        } else {
+            mount->library->setDeduplication(true);
+        }
+    }
+
+    if (mappedWrites) {
+        if (mount->overlay) {
+            mount->overlay->setMappedWrites(true);
+        } else {
+            mount->library->setMappedWrites(true);
+        }
+    }
+    if (imageCacheMiB) {
+        imageViews = true;
+        if (mount->overlay) {
+            mount->overlay->setImageViews(imageCacheMiB << 20);
+        } else {
+            mount->library->setImageViews(imageCacheMiB << 20);
+        }
+    }
+
+    argv[firstWad] = argv[argc - 1];
+    argc = firstWad + 1;
+
+    if (!tracePath.empty()) {
+        // fuse daemonizes and changes directory, keep the dump where the user asked for it
+        if (tracePath.at(0) != '/') {
+            tracePath = std::string(get_current_dir_name()) + "/" + tracePath;
+        }
+        WadTrace::enable(traceEvents);
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    }
 
-    return fuse_main(argc, argv, &operations, myWad);
+    return fuse_main(argc, argv, &operations, mount);
 }
+#endif
@@ -0,0 +1,43 @@
+#include <chrono>
+#include "../libWad/WadBuilder.h"
+
+int main(int argc, char* argv[]) {
+    // usage: wadpack [--magic=IWAD|PWAD|XWAD] [--compress] host_directory output.wad
+    // directories named E#M# become maps, other directories (2 characters max) become namespaces
+    // --compress stores lumps block compressed, implies XWAD
+
+    std::string magic = "PWAD";
+    bool compress = false;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--magic=", 8) == 0) {
+            magic = argv[i] + 8;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            compress = true;
+            magic = WAD_EXTENDED_MAGIC;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (args.size() != 2) {
+        std::cout << "Usage: wadpack [--magic=IWAD|PWAD|XWAD] [--compress] host_directory output.wad" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> skipped;
+    bool ok = WadBuilder::buildFromDirectory(args[0], args[1], magic, &skipped, compress);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (const std::string& path : skipped) {
+        std::cerr << "skipped " << path << std::endl;
+    }
+    if (!ok) {
+        std::cerr << "Could not build " << args[1] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::error_code error;
+    uintmax_t size = std::filesystem::file_size(args[1], error);
+    std::cout << args[1] << ": " << size << " bytes in " << seconds << " s (" << (seconds > 0 ? size / seconds / (1 << 20) : 0) << " MiB/s)" << std::endl;
+    return 0;
+}
@@ -0,0 +1,172 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "../libWad/Wad.h"
+
+struct Job {
+    std::string hostPath;
+    // position among the lumps in table order, see collectLumps
+    size_t lump;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// every lump in table order, the same list for the main archive and each worker's reader
+static void collectLumps(Node* node, std::vector<Node*>* lumps) {
+    for (Node* child : node->children) {
+        if (child->isFile) {
+            lumps->push_back(child);
+        } else {
+            collectLumps(child, lumps);
+        }
+    }
+}
+
+// copies one lump without bringing the bytes into user space when the kernel allows it
+static bool copyLump(int wadFd, const Job& job) {
+    int out = open(job.hostPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        return false;
+    }
+    uint64_t copied = 0;
+    while (copied < job.length) {
+        loff_t inOffset = job.offset + copied;
+        ssize_t n = copy_file_range(wadFd, &inOffset, out, nullptr, job.length - copied, 0);
+        if (n <= 0) {
+            break;
+        }
+        copied += n;
+    }
+    while (copied < job.length) {
+        off_t inOffset = job.offset + copied;
+        ssize_t n = sendfile(out, wadFd, &inOffset, job.length - copied);
+        if (n <= 0) {
+            break;
+        }
+        copied += n;
+    }
+    std::vector<char> chunk(copied < job.length ? 1 << 20 : 0);
+    while (copied < job.length) {
+        ssize_t n = pread(wadFd, chunk.data(), std::min<uint64_t>(chunk.size(), job.length - copied), job.offset + copied);
+        if (n <= 0 || write(out, chunk.data(), n) != n) {
+            break;
+        }
+        copied += n;
+    }
+    return close(out) == 0 && copied == job.length;
+}
+
+// compressed lumps have to be decoded, each worker reads them through its own Wad
+// by node, a path would find the first of several lumps sharing a name
+static bool decodeLump(Wad* wad, Node* node, const Job& job) {
+    int out = open(job.hostPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        return false;
+    }
+    std::vector<char> chunk(1 << 20);
+    uint64_t copied = 0;
+    while (copied < job.length) {
+        ssize_t n = wad->getContents(node, chunk.data(), chunk.size(), copied);
+        if (n <= 0 || write(out, chunk.data(), n) != n) {
+            break;
+        }
+        copied += n;
+    }
+    return close(out) == 0 && copied == job.length;
+}
+
+int main(int argc, char* argv[]) {
+    // usage: wadunpack [--jobs=N] input.wad host_directory
+    // namespaces and maps become directories, lumps become files
+
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            jobs = std::max(1, atoi(argv[i] + 7));
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (args.size() != 2) {
+        std::cout << "Usage: wadunpack [--jobs=N] input.wad host_directory" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Wad* wad = Wad::loadWad(args[0]);
+    if (!wad) {
+        std::cerr << "Could not open " << args[0] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // directories are created up front on this thread, lumps are queued for the workers
+    // a directory may hold several lumps of one name, the last in table order wins like it does
+    // in a mount and the earlier ones are reported, so no two workers write the same file
+    std::vector<Job> queue;
+    std::unordered_map<std::string, size_t> queued;
+    size_t lumps = 0;
+    bool ok = true;
+    std::function<void(Node*, const std::string&)> walk = [&](Node* node, const std::string& hostDir) {
+        std::error_code error;
+        std::filesystem::create_directories(hostDir, error);
+        ok = ok && !error;
+        for (Node* child : node->children) {
+            std::string name = child->fullPath.substr(child->fullPath.find_last_of('/') + 1);
+            if (child->isFile) {
+                Job job{hostDir + "/" + name, lumps++, child->offset, child->length};
+                auto existing = queued.find(job.hostPath);
+                if (existing != queued.end()) {
+                    std::cerr << "Duplicate " << child->fullPath << ", keeping the later one" << std::endl;
+                    queue[existing->second] = job;
+                } else {
+                    queued.emplace(job.hostPath, queue.size());
+                    queue.push_back(job);
+                }
+            } else if (!WadNames::isNamespaceEnd(child->filename)) {
+                walk(child, hostDir + "/" + name);
+            }
+        }
+    };
+    walk(wad->getRoot(), args[1]);
+
+    std::atomic<size_t> next(0);
+    std::atomic<uint64_t> bytes(0);
+    std::atomic<bool> failed(!ok);
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < jobs; ++i) {
+        workers.emplace_back([&]() {
+            int wadFd = open(wad->getFilePath().c_str(), O_RDONLY);
+            Wad* reader = wad->isCompressed() ? Wad::loadWad(wad->getFilePath()) : nullptr;
+            std::vector<Node*> readerLumps;
+            if (reader) {
+                collectLumps(reader->getRoot(), &readerLumps);
+            }
+            if (wadFd < 0 || (wad->isCompressed() && (!reader || readerLumps.size() != lumps))) {
+                failed = true;
+                delete reader;
+                return;
+            }
+            for (size_t j = next++; j < queue.size(); j = next++) {
+                if (reader ? decodeLump(reader, readerLumps[queue[j].lump], queue[j]) : copyLump(wadFd, queue[j])) {
+                    bytes += queue[j].length;
+                } else {
+                    std::cerr << "Could not write " << queue[j].hostPath << std::endl;
+                    failed = true;
+                }
+            }
+            close(wadFd);
+            delete reader;
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    delete wad;
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << queue.size() << " lumps, " << bytes << " bytes in " << seconds << " s (" << (seconds > 0 ? bytes / seconds / (1 << 20) : 0) << " MiB/s, " << jobs << " jobs)" << std::endl;
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,54 @@
+#include <chrono>
+#include "../libWad/WadVerify.h"
+
+int main(int argc, char* argv[]) {
+    // usage: wadverify [--jobs=N] [--sidecar[=FILE]] [--update] [--quick] archive.wad
+    // checks descriptor bounds, overlaps and namespace balance, then crc32c of every lump
+    // --sidecar compares against stored checksums (default FILE is archive.wad.crc)
+    // --update writes this run's checksums to the sidecar, --quick only hashes lumps not in it yet
+
+    WadVerifyOptions options;
+    bool useSidecar = false;
+    std::string sidecar;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            options.threads = std::max(1, atoi(argv[i] + 7));
+        } else if (strcmp(argv[i], "--sidecar") == 0) {
+            useSidecar = true;
+        } else if (strncmp(argv[i], "--sidecar=", 10) == 0) {
+            useSidecar = true;
+            sidecar = argv[i] + 10;
+        } else if (strcmp(argv[i], "--update") == 0) {
+            useSidecar = true;
+            options.updateSidecar = true;
+        } else if (strcmp(argv[i], "--quick") == 0) {
+            useSidecar = true;
+            options.quick = true;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (args.size() != 1) {
+        std::cout << "Usage: wadverify [--jobs=N] [--sidecar[=FILE]] [--update] [--quick] archive.wad" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (useSidecar) {
+        options.sidecar = sidecar.empty() ? args[0] + ".crc" : sidecar;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    WadVerifyReport report;
+    bool ok = WadVerify::verify(args[0], options, &report);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (const std::string& problem : report.problems) {
+        std::cout << problem << std::endl;
+    }
+    std::cout << args[0] << ": " << (ok ? "ok" : "FAILED") << ", " << report.lumps << " lumps, " << report.bytesHashed << " bytes hashed in " << seconds << " s (" << (seconds > 0 ? report.bytesHashed / seconds / (1 << 20) : 0) << " MiB/s)";
+    if (!options.sidecar.empty()) {
+        std::cout << ", " << report.lumpsSkipped << " trusted from sidecar, " << report.lumpsAdded << " new, " << report.lumpsRewritten << " rewritten";
+    }
+    std::cout << std::endl;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}